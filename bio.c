@@ -25,10 +25,16 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
 
+// Buffers come from a slab cache.  The cache fills up to
+// NBUF buffers and then recycles the least recently used
+// one; it grows past NBUF only when every buffer is busy,
+// and breclaim() gives the extra ones back.
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kmcache cache;
+  int nbuf;
 
   // Linked list of all buffers, through prev/next.
   // head.next is most recently used.
@@ -38,21 +44,13 @@ struct {
 void
 binit(void)
 {
-  struct buf *b;
-
   initlock(&bcache.lock, "bcache");
+  kminit(&bcache.cache, "buf", sizeof(struct buf));
 
 //PAGEBREAK!
   // Create linked list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
 }
 
 // Look through buffer cache for block on device dev.
@@ -78,7 +76,7 @@ bget(uint dev, uint blockno)
   // Not cached; recycle an unused buffer.
   // Even if refcnt==0, B_DIRTY indicates a buffer is in use
   // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
+  for(b = bcache.head.prev; bcache.nbuf >= NBUF && b != &bcache.head; b = b->prev){
     if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
       b->dev = dev;
       b->blockno = blockno;
@@ -89,7 +87,23 @@ bget(uint dev, uint blockno)
       return b;
     }
   }
-  panic("bget: no buffers");
+
+  // Or add a new one.
+  if((b = kmalloc(&bcache.cache)) == 0)
+    panic("bget: no buffers");
+  initsleeplock(&b->lock, "buffer");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->next = bcache.head.next;
+  b->prev = &bcache.head;
+  bcache.head.next->prev = b;
+  bcache.head.next = b;
+  bcache.nbuf++;
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -139,6 +153,26 @@ brelse(struct buf *b)
   
   release(&bcache.lock);
 }
+
+// Free unused, clean buffers beyond the first NBUF, least
+// recently used first.  Called by kswapd.
+void
+breclaim(void)
+{
+  struct buf *b, *prev;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.prev; bcache.nbuf > NBUF && b != &bcache.head; b = prev){
+    prev = b->prev;
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0){
+      b->next->prev = b->prev;
+      b->prev->next = b->next;
+      bcache.nbuf--;
+      kmfree(&bcache.cache, b);
+    }
+  }
+  release(&bcache.lock);
+}
 //PAGEBREAK!
 // Blank page.
 
@@ -10,6 +10,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "poll.h"
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
@@ -22,6 +23,7 @@ static int panicked = 0;
 static struct {
   struct spinlock lock;
   int locking;
+  struct pollq pq;  // processes polling for input
 } cons;
 
 static void
@@ -127,17 +129,23 @@ panic(char *s)
 #define BACKSPACE 0x100
 #define CRTPORT 0x3d4
 static ushort *crt = (ushort*)P2V(0xb8000);  // CGA memory
+static int cgapos = -1;  // cursor: col + 80*row
 
+// Put c on the screen without moving the hardware cursor;
+// cgacursor() does that once a batch is done.
 static void
-cgaputc(int c)
+cgaput(int c)
 {
   int pos;
 
-  // Cursor position: col + 80*row.
-  outb(CRTPORT, 14);
-  pos = inb(CRTPORT+1) << 8;
-  outb(CRTPORT, 15);
-  pos |= inb(CRTPORT+1);
+  if(cgapos < 0){
+    // Where the BIOS left the cursor.
+    outb(CRTPORT, 14);
+    cgapos = inb(CRTPORT+1) << 8;
+    outb(CRTPORT, 15);
+    cgapos |= inb(CRTPORT+1);
+  }
+  pos = cgapos;
 
   if(c == '\n')
     pos += 80 - pos%80;
@@ -154,6 +162,13 @@ cgaputc(int c)
     pos -= 80;
     memset(crt+pos, 0, sizeof(crt[0])*(24*80 - pos));
   }
+  cgapos = pos;
+}
+
+static void
+cgacursor(void)
+{
+  int pos = cgapos;
 
   outb(CRTPORT, 14);
   outb(CRTPORT+1, pos>>8);
@@ -162,6 +177,13 @@ cgaputc(int c)
   crt[pos] = ' ' | 0x0700;
 }
 
+static void
+cgaputc(int c)
+{
+  cgaput(c);
+  cgacursor();
+}
+
 void
 consputc(int c)
 {
@@ -171,7 +193,13 @@ consputc(int c)
       ;
   }
 
-  if(c == BACKSPACE){
+  if(!cons.locking){
+    // Panicking, or not set up yet: nothing may wait.
+    if(c == BACKSPACE){
+      uartputcsync('\b'); uartputcsync(' '); uartputcsync('\b');
+    } else
+      uartputcsync(c);
+  } else if(c == BACKSPACE){
     uartputc('\b'); uartputc(' '); uartputc('\b');
   } else
     uartputc(c);
@@ -221,6 +249,7 @@ consoleintr(int (*getc)(void))
         if(c == '\n' || c == C('D') || input.e == input.r+INPUT_BUF){
           input.w = input.e;
           wakeup(&input.r);
+          pollwakeup(&cons.pq);
         }
       }
       break;
@@ -240,6 +269,12 @@ consoleread(struct inode *ip, char *dst, int n)
 
   iunlock(ip);
   target = n;
+  // dst is written under cons.lock; a read returns at most
+  // one line, which fits in the input buffer.
+  if(prefault((uint)dst, n < INPUT_BUF ? n : INPUT_BUF, 1) < 0){
+    ilock(ip);
+    return -1;
+  }
   acquire(&cons.lock);
   while(n > 0){
     while(input.r == input.w){
@@ -270,21 +305,53 @@ consoleread(struct inode *ip, char *dst, int n)
   return target - n;
 }
 
+// Copy each piece of buf out of user memory before taking
+// any lock, since touching it may fault.  The screen is
+// updated a piece at a time under cons.lock; the serial port
+// queues the piece and sends it by interrupt.
 int
 consolewrite(struct inode *ip, char *buf, int n)
 {
-  int i;
+  char kbuf[128];
+  int i, m, off;
 
   iunlock(ip);
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++)
-    consputc(buf[i] & 0xff);
-  release(&cons.lock);
+  for(off = 0; off < n; off += m){
+    m = n - off;
+    if(m > sizeof(kbuf))
+      m = sizeof(kbuf);
+    memmove(kbuf, buf + off, m);
+    acquire(&cons.lock);
+    if(panicked){
+      cli();
+      for(;;)
+        ;
+    }
+    for(i = 0; i < m; i++)
+      cgaput(kbuf[i] & 0xff);
+    cgacursor();
+    release(&cons.lock);
+    uartwrite(kbuf, m);
+  }
   ilock(ip);
 
   return n;
 }
 
+int
+consolepoll(struct inode *ip, struct pollent *pe)
+{
+  int r;
+
+  acquire(&cons.lock);
+  pollwait(&cons.pq, pe);
+  r = POLLOUT;
+  if(input.r != input.w)
+    r |= POLLIN;
+  release(&cons.lock);
+  return r;
+}
+
 void
 consoleinit(void)
 {
@@ -292,6 +359,7 @@ consoleinit(void)
 
   devsw[CONSOLE].write = consolewrite;
   devsw[CONSOLE].read = consoleread;
+  devsw[CONSOLE].poll = consolepoll;
   cons.locking = 1;
 
   ioapicenable(IRQ_KBD, 0);
@@ -6,3 +6,9 @@ struct rtcdate {
   uint month;
   uint year;
 };
+
+// Time since boot, from clocktime().
+struct timespec {
+  uint sec;
+  uint nsec;
+};
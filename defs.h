@@ -1,10 +1,21 @@
 struct buf;
 struct context;
 struct file;
+struct image;
 struct inode;
+struct iovec;
+struct kmcache;
+struct lockstat;
+struct memstat;
 struct pipe;
+struct pollent;
+struct pollfd;
+struct pollq;
 struct proc;
 struct rtcdate;
+struct timespec;
+struct rwlock;
+struct rwsleeplock;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -15,6 +26,7 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            breclaim(void);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +36,7 @@ void            panic(char*) __attribute__((noreturn));
 
 // exec.c
 int             exec(char*, char**);
+pde_t*          execload(char*, char**, struct image**, uint*, uint*);
 
 // file.c
 struct file*    filealloc(void);
@@ -31,8 +44,19 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
+int             filereadv(struct file*, struct iovec*, int);
+int             filepread(struct file*, char*, int n, uint);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filewritev(struct file*, struct iovec*, int);
+int             filepwrite(struct file*, char*, int n, uint);
+int             filesplice(struct file*, struct file*, int n);
+int             filepoll(struct file*, struct pollent*);
+void            fdinit(struct proc*);
+int             fdalloc(struct file*);
+void            fdremove(int);
+int             fdcopy(struct proc*, struct proc*);
+void            fdcloseall(struct proc*);
 
 
 // fs.c
@@ -41,10 +65,14 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            icacheinit(void);
 void            iinit(int dev);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
+void            idrop(struct inode*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
@@ -54,12 +82,23 @@ int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 uint            bmap_addr(struct inode *, uint);
+struct buf*     ibread(struct inode*, uint);
 
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
 
+// image.c
+void            imginit(void);
+struct image*   imgget(struct inode*);
+struct image*   imgdup(struct image*);
+void            imgput(struct image*);
+int             imgbusy(struct inode*);
+void            imginval(struct inode*);
+int             imgpage(struct image*, uint, char**);
+int             imgreclaim(int);
+
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
 extern uchar    ioapicid;
@@ -68,6 +107,18 @@ void            ioapicinit(void);
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+char*           kallocn(int);
+char*           kzalloc(void);
+void            kzerofill(void);
+void            kfreen(char*, int);
+void            kmemstat(struct memstat*);
+void            kref(char*);
+int             krefcnt(char*);
+char*           kzeropage(void);
+int             kfreecount(void);
+char*           ksuperalloc(void);
+void            ksuperfree(char*);
+void            ksplit(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -81,6 +132,10 @@ extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
+void            lapicipi(uchar, int);
+void            lapictimer(int);
+uint64          nsectime(void);
+void            clocktime(struct timespec*);
 void            microdelay(int);
 
 // log.c
@@ -98,17 +153,33 @@ void            picenable(int);
 void            picinit(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
+int             pipewait(struct pipe*);
+int             pipeput(struct pipe*, char*, int);
+int             piperesize(struct pipe*, int);
+int             pipepoll(struct pipe*, struct pollent*);
+
+// poll.c
+void            pollinit(void);
+void            pollwait(struct pollq*, struct pollent*);
+void            pollwakeup(struct pollq*);
+void            polltick(void);
+int             poll(struct pollfd*, int, int);
 
 //PAGEBREAK: 16
 // proc.c
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             spawn(char*, char**, struct file**);
 int             growproc(int);
+void            kthread(char*, void (*)(void));
+int             pgdirref(pde_t*);
+void            askreclaim(int);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
@@ -121,6 +192,7 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
+void            wakeupone(void*);
 void            yield(void);
 void            procdump_ps(void);
 uint            munmap(uint, int);
@@ -131,6 +203,14 @@ int             join(void);
 int             mutex_lock(void*);
 int             mutex_unlock(void*);
 
+// rcu.c
+void            rcuinit(void);
+void            rcubegin(void);
+void            rcuend(void);
+void            rcudefer(void(*)(void*), void*);
+void            rcuquiesce(void);
+void            rcupoll(void);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
@@ -140,6 +220,12 @@ void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+int             klockstat(struct lockstat*, int);
+void            initrwlock(struct rwlock*, char*);
+void            rlock(struct rwlock*);
+void            runlock(struct rwlock*);
+void            wlock(struct rwlock*);
+void            wunlock(struct rwlock*);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
@@ -149,6 +235,17 @@ void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            initrwsleeplock(struct rwsleeplock*, char*);
+void            acquireread(struct rwsleeplock*);
+void            releaseread(struct rwsleeplock*);
+void            acquirewrite(struct rwsleeplock*);
+void            releasewrite(struct rwsleeplock*);
+int             holdingwrite(struct rwsleeplock*);
+
+// slab.c
+void            kminit(struct kmcache*, char*, uint);
+void*           kmalloc(struct kmcache*);
+void            kmfree(struct kmcache*, void*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -173,6 +270,7 @@ void            timerinit(void);
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
+int             sleepticks(int);
 void            tvinit(void);
 extern struct spinlock tickslock;
 
@@ -180,6 +278,8 @@ extern struct spinlock tickslock;
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
+void            uartputcsync(int);
+void            uartwrite(char*, int);
 
 // vm.c
 void            seginit(void);
@@ -194,14 +294,23 @@ int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
+void            tlbflush(pde_t*, uint, uint);
+void            tlbintr(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
 uint*           walkpgdir(pde_t*, const void*, int);
 int             mappages(pde_t *, void *, uint, uint, int);
+int             pagefault(uint, int, int);
+int             prefault(uint, uint, int);
 
 // swap.c
 void swapread(char* ptr, int blkno);
 void swapwrite(char* ptr, int blkno);
+void            swapinit(void);
+void            swapfree(int);
+void            swapload(char*, int);
+int             swapself(int);
+int             kreclaim(int);
 
 int argfd(int, int*, struct file**);
 // number of elements in fixed-size array
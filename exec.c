@@ -5,60 +5,47 @@
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
-#include "elf.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "image.h"
 
-int
-exec(char *path, char **argv)
+// Build a new user address space for the program at path,
+// with the argument strings argv on its stack.  On success
+// returns the page table and fills in the program's image,
+// size and initial stack pointer; otherwise returns 0.
+// Leaves the current process alone, so that spawn() can use
+// it for a new one.
+pde_t*
+execload(char *path, char **argv, struct image **pimg, uint *psz, uint *psp)
 {
-  char *s, *last;
-  int i, off;
   uint argc, sz, sp, ustack[3+MAXARG+1];
-  struct elfhdr elf;
   struct inode *ip;
-  struct proghdr ph;
-  pde_t *pgdir, *oldpgdir;
-  struct proc *curproc = myproc();
+  struct image *img;
+  pde_t *pgdir;
 
   begin_op();
 
   if((ip = namei(path)) == 0){
     end_op();
     cprintf("exec: fail\n");
-    return -1;
+    return 0;
   }
   ilock(ip);
+  img = imgget(ip);
+  iunlockput(ip);
+  end_op();
+  if(img == 0)
+    return 0;
   pgdir = 0;
 
-  // Check ELF header
-  if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
-    goto bad;
-  if(elf.magic != ELF_MAGIC)
-    goto bad;
-
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
-  sz = 0;
-  for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
-    if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
-      goto bad;
-    if(ph.type != ELF_PROG_LOAD)
-      continue;
-    if(ph.memsz < ph.filesz)
-      goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
-      goto bad;
-  }
-  iunlockput(ip);
-  end_op();
-  ip = 0;
+  // The program itself is not read in here: pagefault()
+  // fills in each page of img on first touch.
+  sz = img->sz;
 
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible.  Use the second as the user stack.
@@ -90,6 +77,30 @@ exec(char *path, char **argv)
   if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
     goto bad;
 
+  *pimg = img;
+  *psz = sz;
+  *psp = sp;
+  return pgdir;
+
+ bad:
+  if(pgdir)
+    freevm(pgdir);
+  imgput(img);
+  return 0;
+}
+
+int
+exec(char *path, char **argv)
+{
+  char *s, *last;
+  uint sz, sp;
+  struct image *img, *oldimg;
+  pde_t *pgdir, *oldpgdir;
+  struct proc *curproc = myproc();
+
+  if((pgdir = execload(path, argv, &img, &sz, &sp)) == 0)
+    return -1;
+
   // Save program name for debugging.
   for(last=s=path; *s; s++)
     if(*s == '/')
@@ -98,20 +109,15 @@ exec(char *path, char **argv)
 
   // Commit to the user image.
   oldpgdir = curproc->pgdir;
+  oldimg = curproc->img;
   curproc->pgdir = pgdir;
+  curproc->img = img;
   curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
+  curproc->tf->eip = img->entry;  // main
   curproc->tf->esp = sp;
   switchuvm(curproc);
   freevm(oldpgdir);
+  if(oldimg)
+    imgput(oldimg);
   return 0;
-
- bad:
-  if(pgdir)
-    freevm(pgdir);
-  if(ip){
-    iunlockput(ip);
-    end_op();
-  }
-  return -1;
-}
\ No newline at end of file
+}
@@ -5,21 +5,33 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "stat.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "buf.h"
 #include "file.h"
+#include "poll.h"
+#include "uio.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+
+// File structures come from a slab cache, so there is no
+// fixed limit and allocation never scans.  ftable.lock
+// protects the reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmcache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kminit(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -28,16 +40,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmalloc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,6 +76,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmfree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -79,6 +87,99 @@ fileclose(struct file *f)
   }
 }
 
+//PAGEBREAK!
+// Per-process descriptor tables.  A process starts out with
+// the NOFILE slots inside struct proc and moves to a page of
+// NOFILEMAX slots the first time those run out.
+
+// Reset p's descriptor table to the empty built-in one.
+void
+fdinit(struct proc *p)
+{
+  memset(p->ofile0, 0, sizeof(p->ofile0));
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
+  p->fdfree = 0;
+}
+
+// Make room for n descriptors in p's table.
+static int
+fdgrow(struct proc *p, int n)
+{
+  struct file **t;
+
+  if(n <= p->nofile)
+    return 0;
+  if(n > NOFILEMAX || (t = (struct file**)kzalloc()) == 0)
+    return -1;
+  memmove(t, p->ofile, p->nofile * sizeof(t[0]));
+  p->ofile = t;
+  p->nofile = NOFILEMAX;
+  return 0;
+}
+
+// Allocate the lowest free file descriptor for f.
+// Takes over file reference from caller on success.
+int
+fdalloc(struct file *f)
+{
+  struct proc *p = myproc();
+  int fd;
+
+  for(fd = p->fdfree; fd < p->nofile; fd++)
+    if(p->ofile[fd] == 0)
+      break;
+  if(fdgrow(p, fd + 1) < 0)
+    return -1;
+  p->ofile[fd] = f;
+  p->fdfree = fd + 1;
+  return fd;
+}
+
+// Release descriptor fd of the current process.
+// The caller closes the file.
+void
+fdremove(int fd)
+{
+  struct proc *p = myproc();
+
+  p->ofile[fd] = 0;
+  if(fd < p->fdfree)
+    p->fdfree = fd;
+}
+
+// Give np, whose table is empty, a copy of p's descriptors.
+int
+fdcopy(struct proc *np, struct proc *p)
+{
+  int fd;
+
+  if(fdgrow(np, p->nofile) < 0)
+    return -1;
+  for(fd = 0; fd < p->nofile; fd++)
+    if(p->ofile[fd])
+      np->ofile[fd] = filedup(p->ofile[fd]);
+  np->fdfree = p->fdfree;
+  return 0;
+}
+
+// Close every descriptor of p and free its table.
+void
+fdcloseall(struct proc *p)
+{
+  int fd;
+
+  for(fd = 0; fd < p->nofile; fd++){
+    if(p->ofile[fd]){
+      fileclose(p->ofile[fd]);
+      p->ofile[fd] = 0;
+    }
+  }
+  if(p->ofile != p->ofile0)
+    kfree((char*)p->ofile);
+  fdinit(p);
+}
+
 // Get metadata about file f.
 int
 filestat(struct file *f, struct stat *st)
@@ -92,66 +193,323 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+// Fault in n bytes of the cnt buffers of iov, starting
+// used bytes into iov[i], before ip is locked: a page mapped
+// from ip itself could not be read in while ip is locked.
+// Devices drop ip->lock and see to their own copies.
+static int
+iovprefault(struct iovec *iov, int cnt, int i, uint used, uint n, int write)
+{
+  uint m;
+
+  for(; i < cnt && n > 0; i++, used = 0){
+    m = iov[i].iov_len - used;
+    if(m > n)
+      m = n;
+    if(prefault((uint)iov[i].iov_base + used, m, write) < 0)
+      return -1;
+    n -= m;
+  }
+  return 0;
+}
+
+// Read from inode ip at *off into the cnt buffers of iov,
+// advancing *off.  Stops at the first short read.
+static int
+readiv(struct inode *ip, struct iovec *iov, int cnt, uint *off)
+{
+  int i, r, tot;
+  uint n;
+
+  // A file fills no more than its size; the unlocked look
+  // only decides how much to fault in ahead.
+  n = 0;
+  if(ip->type != T_DEV && ip->size > *off)
+    n = ip->size - *off;
+  if(iovprefault(iov, cnt, 0, 0, n, 1) < 0)
+    return -1;
+
+  tot = 0;
+  ilock(ip);
+  for(i = 0; i < cnt; i++){
+    if((r = readi(ip, iov[i].iov_base, *off, iov[i].iov_len)) < 0){
+      if(tot == 0)
+        tot = -1;
+      break;
+    }
+    *off += r;
+    tot += r;
+    if(r != iov[i].iov_len)
+      break;
+  }
+  iunlock(ip);
+  return tot;
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
 {
-  int r;
+  struct iovec iov;
 
   if(f->readable == 0)
     return -1;
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
-    return r;
+    iov.iov_base = addr;
+    iov.iov_len = n;
+    return readiv(f->ip, &iov, 1, &f->off);
   }
   panic("fileread");
 }
 
+// Read from file f into cnt buffers.  A pipe read returns
+// as soon as some data has arrived, so it goes through one
+// kernel page and is scattered from there.
+int
+filereadv(struct file *f, struct iovec *iov, int cnt)
+{
+  int i, r;
+  uint n, m;
+  char *kbuf;
+
+  if(f->readable == 0)
+    return -1;
+  if(f->type == FD_INODE)
+    return readiv(f->ip, iov, cnt, &f->off);
+  if(f->type != FD_PIPE)
+    panic("filereadv");
+
+  // At most a page; stop adding before the sum can wrap.
+  for(n = 0, i = 0; i < cnt && n < PGSIZE; i++)
+    n += iov[i].iov_len < PGSIZE ? iov[i].iov_len : PGSIZE;
+  if(n > PGSIZE)
+    n = PGSIZE;
+  if((kbuf = kalloc()) == 0)
+    return -1;
+  r = piperead(f->pipe, kbuf, n);
+  for(n = 0, i = 0; i < cnt && (int)n < r; i++, n += m){
+    m = r - n;
+    if(m > iov[i].iov_len)
+      m = iov[i].iov_len;
+    memmove(iov[i].iov_base, kbuf + n, m);
+  }
+  kfree(kbuf);
+  return r;
+}
+
+// Read n bytes from file f at offset off, leaving f->off alone.
+int
+filepread(struct file *f, char *addr, int n, uint off)
+{
+  struct iovec iov;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  iov.iov_base = addr;
+  iov.iov_len = n;
+  return readiv(f->ip, &iov, 1, &off);
+}
+
+// Report which poll events hold for f, and hang pe on the
+// wait queue behind f so that a change wakes the poller.
+// Plain files are always ready.
+int
+filepoll(struct file *f, struct pollent *pe)
+{
+  int r, major;
+
+  if(f->type == FD_PIPE)
+    r = pipepoll(f->pipe, pe);
+  else if(f->type == FD_INODE){
+    ilock(f->ip);
+    major = f->ip->type == T_DEV ? f->ip->major : -1;
+    iunlock(f->ip);
+    if(major >= 0 && major < NDEV && devsw[major].poll)
+      r = devsw[major].poll(f->ip, pe);
+    else
+      r = POLLIN | POLLOUT;
+  } else
+    panic("filepoll");
+  if(f->readable == 0)
+    r &= ~(POLLIN | POLLHUP);
+  if(f->writable == 0)
+    r &= ~(POLLOUT | POLLERR);
+  return r;
+}
+
 //PAGEBREAK!
+// Write the cnt buffers of iov to inode ip at *off, advancing
+// *off.  Consecutive buffers share a log transaction until it
+// is full, so many small pieces cost about as much as one big
+// write.
+static int
+writeiv(struct inode *ip, struct iovec *iov, int cnt, uint *off)
+{
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+  int i, r, tot, done;
+  uint m, used;
+
+  i = 0;
+  used = 0;
+  tot = 0;
+  r = 0;
+  while(i < cnt && r >= 0){
+    if(ip->type != T_DEV && iovprefault(iov, cnt, i, used, max, 0) < 0)
+      return tot > 0 ? tot : -1;
+    begin_op();
+    ilock(ip);
+    for(done = 0; i < cnt && done < max; ){
+      m = iov[i].iov_len - used;
+      if(m > max - done)
+        m = max - done;
+      if((r = writei(ip, (char*)iov[i].iov_base + used, *off, m)) < 0)
+        break;
+      if(r != m)
+        panic("short filewrite");
+      *off += r;
+      done += r;
+      if((used += r) == iov[i].iov_len){
+        i++;
+        used = 0;
+      }
+    }
+    iunlock(ip);
+    end_op();
+    tot += done;
+  }
+  return r < 0 ? -1 : tot;
+}
+
 // Write to file f.
 int
 filewrite(struct file *f, char *addr, int n)
 {
-  int r;
+  struct iovec iov;
 
   if(f->writable == 0)
     return -1;
   if(f->type == FD_PIPE)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r < 0)
-        break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
-    }
-    return i == n ? n : -1;
+    iov.iov_base = addr;
+    iov.iov_len = n;
+    return writeiv(f->ip, &iov, 1, &f->off);
   }
   panic("filewrite");
 }
 
+// Write cnt buffers to file f.
+int
+filewritev(struct file *f, struct iovec *iov, int cnt)
+{
+  int i, tot;
+
+  if(f->writable == 0)
+    return -1;
+  if(f->type == FD_INODE)
+    return writeiv(f->ip, iov, cnt, &f->off);
+  if(f->type != FD_PIPE)
+    panic("filewritev");
+  for(tot = 0, i = 0; i < cnt; i++){
+    if(pipewrite(f->pipe, iov[i].iov_base, iov[i].iov_len) < 0)
+      return tot > 0 ? tot : -1;
+    tot += iov[i].iov_len;
+  }
+  return tot;
+}
+
+// Write n bytes to file f at offset off, leaving f->off alone.
+int
+filepwrite(struct file *f, char *addr, int n, uint off)
+{
+  struct iovec iov;
+
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  iov.iov_base = addr;
+  iov.iov_len = n;
+  return writeiv(f->ip, &iov, 1, &off);
+}
+
+//PAGEBREAK!
+// Move up to n bytes from in to out inside the kernel, so
+// that data never makes a round trip through user memory.
+// Returns the number of bytes moved, 0 at end of input.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  int r, m, tot;
+  char *kbuf;
+  struct buf *bp;
+  struct inode *ip;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+
+  // File to pipe: copy straight from the buffer cache into
+  // the pipe ring.  Wait for room before taking the block
+  // so that we never sleep on the pipe while holding a buf.
+  if(in->type == FD_INODE && out->type == FD_PIPE){
+    ip = in->ip;
+    ilock(ip);
+    r = ip->type == T_DEV;
+    iunlock(ip);
+    if(!r){
+      for(tot = 0; tot < n; tot += r){
+        if(pipewait(out->pipe) < 0)
+          return tot > 0 ? tot : -1;
+        ilock(ip);
+        if(in->off >= ip->size){
+          iunlock(ip);
+          break;
+        }
+        m = n - tot;
+        if(m > BSIZE - in->off%BSIZE)
+          m = BSIZE - in->off%BSIZE;
+        if(m > ip->size - in->off)
+          m = ip->size - in->off;
+        // pipeput() never sleeps, so keep ip locked until
+        // in->off moves on, as readiv() does; another read
+        // of in must not start from the same offset.
+        bp = ibread(ip, in->off);
+        r = pipeput(out->pipe, (char*)bp->data + in->off%BSIZE, m);
+        brelse(bp);
+        if(r > 0)
+          in->off += r;
+        iunlock(ip);
+        if(r < 0)
+          return tot > 0 ? tot : -1;
+      }
+      return tot;
+    }
+  }
+
+  // Everything else goes through one kernel page, which
+  // still saves the copies to and from user space and
+  // one system call per chunk.
+  if((kbuf = kalloc()) == 0)
+    return -1;
+  for(tot = 0; tot < n; tot += r){
+    m = n - tot;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    if((r = fileread(in, kbuf, m)) <= 0)
+      break;
+    if(filewrite(out, kbuf, r) != r){
+      r = -1;
+      break;
+    }
+  }
+  kfree(kbuf);
+  if(r < 0 && tot == 0)
+    return -1;
+  return tot;
+}
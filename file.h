@@ -1,3 +1,16 @@
+// Wait queue for poll().  A process blocked in poll()
+// hangs one pollent on the pollq of each object it watches.
+struct pollq {
+  struct pollent *head;
+};
+
+struct pollent {
+  struct pollent *next;
+  struct pollq *q;       // queue this entry is on, if any
+  struct pollwaiter *w;
+  struct file *f;        // polled file, held until poll() returns
+};
+
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE } type;
   int ref; // reference count
@@ -14,8 +27,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
-  struct sleeplock lock; // protects everything below here
+  struct inode *next; // On an icache hash chain
+  struct rwsleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int hasimg;         // an executable image may be cached (image.c)
 
   short type;         // copy of disk inode
   short major;
@@ -30,6 +45,7 @@ struct inode {
 struct devsw {
   int (*read)(struct inode*, char*, int);
   int (*write)(struct inode*, char*, int);
+  int (*poll)(struct inode*, struct pollent*);
 };
 
 extern struct devsw devsw[];
@@ -14,12 +14,14 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
+#include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
@@ -119,12 +121,11 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and
+//   current directories). iget() finds or creates a
+//   cache entry and increments its ref; iput() decrements
+//   ref and frees the entry when it reaches zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
@@ -154,30 +155,42 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// Entries come from a slab cache and are hashed on inode
+// number, so the number of active inodes is bounded only by
+// memory.  The icache.lock spin-lock orders changes to the
+// hash chains.  iget() looks through a chain without it, as
+// an RCU reader (rcu.c): iput() frees an entry only through
+// rcudefer(), and ip->ref changes atomically, so a lookup can
+// take a reference without the lock unless the last one is
+// gone.  ip->dev and ip->inum do not change while an entry
+// is on a chain.
 //
-// An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
-// read or write that inode's ip->valid, ip->size, ip->type, &c.
+// An ip->lock reader-writer sleep-lock protects all ip-> fields
+// other than ref, dev, and inum.  One must hold ip->lock in
+// order to read or write that inode's ip->valid, ip->size,
+// ip->type, &c.  Path lookup holds it shared, so lookups
+// through the same directories do not wait for each other.
+
+#define NIHASH 61
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmcache cache;
+  struct inode *hash[NIHASH];
 } icache;
 
+// Set up the inode cache.  Called from main(), since the
+// first process looks up "/" before iinit() runs.
 void
-iinit(int dev)
+icacheinit(void)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  kminit(&icache.cache, "inode", sizeof(struct inode));
+}
 
+void
+iinit(int dev)
+{
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
@@ -235,37 +248,68 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+// Take a reference to ip, unless its last one is gone and
+// iput() is freeing it.
+static int
+irefget(struct inode *ip)
+{
+  int r;
+
+  while((r = ip->ref) > 0)
+    if(cmpxchg((uint*)&ip->ref, r, r+1) == r)
+      return 1;
+  return 0;
+}
+
+// The cached entry for inode inum on dev, with a reference
+// taken, or 0.  Caller holds icache.lock or is an RCU reader.
+static struct inode*
+ifind(uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = icache.hash[inum % NIHASH]; ip; ip = ip->next)
+    if(ip->dev == dev && ip->inum == inum && irefget(ip))
+      return ip;
+  return 0;
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
+  struct inode *ip, **h;
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  rcubegin();
+  ip = ifind(dev, inum);
+  rcuend();
+  if(ip)
+    return ip;
+
+  acquire(&icache.lock);
+  // Someone may have added it meanwhile.
+  if((ip = ifind(dev, inum)) != 0){
+    release(&icache.lock);
+    return ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate an inode cache entry.
+  if((ip = kmalloc(&icache.cache)) == 0)
     panic("iget: no inodes");
-
-  ip = empty;
+  initrwsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hasimg = 0;
+  h = &icache.hash[inum % NIHASH];
+  ip->next = *h;
+  // Readers must see the entry filled in before they see it.
+  __sync_synchronize();
+  *h = ip;
   release(&icache.lock);
 
   return ip;
@@ -276,9 +320,7 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
-  ip->ref++;
-  release(&icache.lock);
+  xadd((uint*)&ip->ref, 1);
   return ip;
 }
 
@@ -293,7 +335,7 @@ ilock(struct inode *ip)
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquiresleep(&ip->lock);
+  acquirewrite(&ip->lock);
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -311,19 +353,54 @@ ilock(struct inode *ip)
   }
 }
 
+// Lock the given inode shared with other readers, which may
+// look at it but not change it.
+// Reads the inode from disk if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquireread(&ip->lock);
+  while(ip->valid == 0){
+    // Reading it in changes it; that takes ip->lock exclusive.
+    releaseread(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    acquireread(&ip->lock);
+  }
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+  if(ip == 0 || !holdingwrite(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
-  releasesleep(&ip->lock);
+  releasewrite(&ip->lock);
+}
+
+// Unlock an inode locked with ilockshared().
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releaseread(&ip->lock);
+}
+
+static void
+ifree(void *ip)
+{
+  kmfree(&icache.cache, ip);
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -331,7 +408,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquiresleep(&ip->lock);
+  struct inode **pp;
+
+  acquirewrite(&ip->lock);
   if(ip->valid && ip->nlink == 0){
     acquire(&icache.lock);
     int r = ip->ref;
@@ -344,11 +423,31 @@ iput(struct inode *ip)
       ip->valid = 0;
     }
   }
-  releasesleep(&ip->lock);
+  releasewrite(&ip->lock);
 
+  // Once ref is 0 no lookup can take a reference, so the last
+  // one unlinks the entry; readers may still be looking at it
+  // until rcudefer() frees it.
   acquire(&icache.lock);
-  ip->ref--;
+  if(xadd((uint*)&ip->ref, -1) > 1){
+    release(&icache.lock);
+    return;
+  }
+  for(pp = &icache.hash[ip->inum % NIHASH]; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
   release(&icache.lock);
+  rcudefer(ifree, ip);
+}
+
+// Drop a reference to ip that the caller knows is not the
+// last, so that nothing can need freeing.  Unlike iput(),
+// may be called with ip->lock held.
+void
+idrop(struct inode *ip)
+{
+  if(xadd((uint*)&ip->ref, -1) < 2)
+    panic("idrop");
 }
 
 // Common idiom: unlock, then put.
@@ -526,6 +625,16 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   return n;
 }
 
+// Return a locked buf holding the block of ip that
+// contains byte offset off, so callers can copy out of
+// the buffer cache directly (see filesplice).
+// Caller must hold ip->lock and off must be < ip->size.
+struct buf*
+ibread(struct inode *ip, uint off)
+{
+  return bread(ip->dev, bmap(ip, off/BSIZE));
+}
+
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
@@ -545,6 +654,12 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(ip->hasimg){
+    // Refuse to change a program that is running.
+    if(imgbusy(ip))
+      return -1;
+    imginval(ip);
+  }
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -683,21 +798,22 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    iunlockshared(ip);
+    iput(ip);
+    if(next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
@@ -720,7 +836,9 @@ nameiparent(char *path, char *name)
   return namex(path, 1, name);
 }
 
-#define SWAPBASE	500
+// Swap lives on the boot disk past the kernel, which has
+// outgrown the first 500 blocks.
+#define SWAPBASE	2048
 #define SWAPMAX		(100000 - SWAPBASE)
 
 void swapread(char* ptr, int blkno)
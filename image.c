@@ -0,0 +1,387 @@
+// Executable images, shared by the processes running the
+// same file.  See image.h.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "elf.h"
+#include "image.h"
+
+struct {
+  struct spinlock lock;
+  struct image image[NIMAGE];
+  uint clock;    // advances on every imgput, for lastuse
+} imgtable;
+
+void
+imginit(void)
+{
+  int i;
+
+  initlock(&imgtable.lock, "imgtable");
+  for(i = 0; i < NIMAGE; i++)
+    initsleeplock(&imgtable.image[i].lock, "image");
+}
+
+// Read the ELF header of ip into img and check that its
+// loadable segments are page-aligned, in ascending order,
+// and lie inside the file and below KERNBASE.
+static int
+imgparse(struct image *img, struct inode *ip)
+{
+  struct elfhdr elf;
+  struct proghdr ph;
+  struct imgseg *s;
+  int i, off;
+
+  if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
+    return -1;
+  if(elf.magic != ELF_MAGIC)
+    return -1;
+  img->entry = elf.entry;
+  img->sz = 0;
+  img->nseg = 0;
+  for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
+    if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
+      return -1;
+    if(ph.type != ELF_PROG_LOAD)
+      continue;
+    if(ph.memsz < ph.filesz)
+      return -1;
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE)
+      return -1;
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr < PGROUNDUP(img->sz))
+      return -1;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      return -1;
+    if(img->nseg == NIMGSEG)
+      return -1;
+    s = &img->seg[img->nseg++];
+    s->va = ph.vaddr;
+    s->memsz = ph.memsz;
+    s->off = ph.off;
+    s->filesz = ph.filesz;
+    img->sz = ph.vaddr + ph.memsz;
+  }
+  return 0;
+}
+
+// Take the pages and inode of an unused image out of the
+// table so that the caller can free them after releasing
+// imgtable.lock.  Returns the inode.
+static struct inode*
+imgdetach(struct image *img, char ***ppage)
+{
+  struct inode *ip;
+
+  if(img->ref != 0)
+    panic("imgdetach");
+  ip = img->ip;
+  *ppage = img->page;
+  img->ip = 0;
+  img->page = 0;
+  return ip;
+}
+
+// Free the pages of a detached image.  Returns the number
+// of pages that are free now, not still mapped somewhere.
+static int
+imgfree(char **page)
+{
+  int i, n;
+
+  n = 1;
+  for(i = 0; i < NIMGPAGE; i++){
+    if(page[i]){
+      if(krefcnt(page[i]) == 1)
+        n++;
+      kfree(page[i]);
+    }
+  }
+  kfree((char*)page);
+  return n;
+}
+
+// Return the least recently used cached image, and count
+// the cached images in *n.  Called with imgtable.lock held.
+static struct image*
+imgoldest(int *n)
+{
+  struct image *img, *old;
+
+  old = 0;
+  *n = 0;
+  for(img = imgtable.image; img < &imgtable.image[NIMAGE]; img++){
+    if(img->ref == 0 && img->ip){
+      (*n)++;
+      if(old == 0 || img->lastuse - old->lastuse > (uint)1<<31)
+        old = img;
+    }
+  }
+  return old;
+}
+
+// Find the image of the executable ip, setting up a new
+// one if it is neither running nor cached.  Caller must
+// hold ip->lock, which also keeps a second exec of ip from
+// seeing the image before it is set up, and must be inside
+// a transaction.
+struct image*
+imgget(struct inode *ip)
+{
+  struct image *img, *empty;
+  struct inode *oldip;
+  char **page;
+  int n;
+
+  acquire(&imgtable.lock);
+  empty = 0;
+  for(img = imgtable.image; img < &imgtable.image[NIMAGE]; img++){
+    if(img->ip && !img->stale && img->dev == ip->dev && img->inum == ip->inum){
+      img->ref++;
+      release(&imgtable.lock);
+      return img;
+    }
+    if(empty == 0 && img->ref == 0 && img->ip == 0)
+      empty = img;
+  }
+  oldip = 0;
+  if(empty == 0){
+    // Table full: recycle the least recently used cached image.
+    if((empty = imgoldest(&n)) == 0){
+      release(&imgtable.lock);
+      return 0;
+    }
+    oldip = imgdetach(empty, &page);
+  }
+  img = empty;
+  img->dev = ip->dev;
+  img->inum = ip->inum;
+  img->ref = 1;
+  img->stale = 0;
+  release(&imgtable.lock);
+
+  if(oldip){
+    imgfree(page);
+    iput(oldip);
+  }
+
+  if(imgparse(img, ip) < 0 || (img->page = (char**)kzalloc()) == 0){
+    acquire(&imgtable.lock);
+    img->ref = 0;
+    release(&imgtable.lock);
+    return 0;
+  }
+  img->ip = idup(ip);
+  ip->hasimg = 1;
+  return img;
+}
+
+// Increment ref count for image img.
+struct image*
+imgdup(struct image *img)
+{
+  acquire(&imgtable.lock);
+  if(img->ref < 1)
+    panic("imgdup");
+  img->ref++;
+  release(&imgtable.lock);
+  return img;
+}
+
+// Drop a reference to img.  When the last process lets go
+// the image stays cached for the next exec, and the least
+// recently used cached image goes if there are too many.
+// Must not be called inside a transaction.
+void
+imgput(struct image *img)
+{
+  struct inode *ip;
+  char **page;
+  int n;
+
+  acquire(&imgtable.lock);
+  if(img->ref < 1)
+    panic("imgput");
+  if(--img->ref > 0){
+    release(&imgtable.lock);
+    return;
+  }
+  img->lastuse = ++imgtable.clock;
+  if(!img->stale && ((img = imgoldest(&n)) == 0 || n <= NIMGCACHE)){
+    release(&imgtable.lock);
+    return;
+  }
+  ip = imgdetach(img, &page);
+  release(&imgtable.lock);
+
+  imgfree(page);
+  begin_op();
+  iput(ip);
+  end_op();
+}
+
+// Is some process running the executable ip?  Its pages are
+// read in from ip as they are touched, so ip must not change
+// meanwhile.  Caller must hold ip->lock, which keeps exec()
+// from starting to run it.
+int
+imgbusy(struct inode *ip)
+{
+  struct image *img;
+  int busy;
+
+  busy = 0;
+  acquire(&imgtable.lock);
+  for(img = imgtable.image; img < &imgtable.image[NIMAGE]; img++)
+    if(img->ip == ip && img->ref > 0)
+      busy = 1;
+  release(&imgtable.lock);
+  return busy;
+}
+
+// The executable ip is going away.  Make the next exec read
+// it afresh and drop the cached image, if any.  Processes
+// already running it keep reading the file as it is, so
+// until they exit ip->hasimg stays set and imgbusy() keeps
+// writes out.  Caller must hold ip->lock and be inside a
+// transaction.
+void
+imginval(struct inode *ip)
+{
+  struct image *img;
+  char **page;
+  int busy;
+
+  busy = 0;
+  acquire(&imgtable.lock);
+  for(img = imgtable.image; img < &imgtable.image[NIMAGE]; img++){
+    if(img->ip != ip)
+      continue;
+    img->stale = 1;
+    if(img->ref > 0){
+      busy = 1;
+      continue;
+    }
+    imgdetach(img, &page);
+    release(&imgtable.lock);
+    imgfree(page);
+    idrop(ip);  // the caller holds another reference
+    acquire(&imgtable.lock);
+  }
+  ip->hasimg = busy;
+  release(&imgtable.lock);
+}
+
+// Free memory for kswapd: first cached images, least
+// recently used first, then pages of running images that
+// no process has mapped at the moment, which imgpage() will
+// read in again.  Stops once about n pages are freed, and
+// returns how many were.
+int
+imgreclaim(int n)
+{
+  struct image *img;
+  struct inode *ip;
+  char **page;
+  int freed, i, cached;
+
+  freed = 0;
+  while(freed < n){
+    acquire(&imgtable.lock);
+    if((img = imgoldest(&cached)) == 0){
+      release(&imgtable.lock);
+      break;
+    }
+    ip = imgdetach(img, &page);
+    release(&imgtable.lock);
+    freed += imgfree(page);
+    begin_op();
+    iput(ip);
+    end_op();
+  }
+
+  for(img = imgtable.image; img < &imgtable.image[NIMAGE] && freed < n; img++){
+    acquire(&imgtable.lock);
+    if(img->ref == 0){
+      release(&imgtable.lock);
+      continue;
+    }
+    img->ref++;
+    release(&imgtable.lock);
+    // imgpage() hands out references under img->lock, so a
+    // page with no reference but ours cannot gain one.
+    acquiresleep(&img->lock);
+    for(i = 0; i < NIMGPAGE && freed < n; i++){
+      if(img->page[i] && krefcnt(img->page[i]) == 1){
+        kfree(img->page[i]);
+        img->page[i] = 0;
+        freed++;
+      }
+    }
+    releasesleep(&img->lock);
+    imgput(img);
+  }
+  return freed;
+}
+
+// Find the page of img holding address va.  If some of it
+// comes from the file, read it in if no process has yet,
+// and set *pp to it with a reference for the caller.  If
+// not, set *pp to 0: the page is plain zero-filled memory.
+// Returns 0, -1 if the file cannot be read, or 1 if there
+// is no memory for the page just now.
+int
+imgpage(struct image *img, uint va, char **pp)
+{
+  struct imgseg *s;
+  char *mem;
+  uint i, n;
+
+  *pp = 0;
+  va = PGROUNDDOWN(va);
+  for(s = img->seg; s < &img->seg[img->nseg]; s++)
+    if(va >= s->va && va < s->va + s->memsz)
+      break;
+  if(s == &img->seg[img->nseg] || va - s->va >= s->filesz)
+    return 0;
+
+  i = va / PGSIZE;
+  acquiresleep(&img->lock);
+  if(i < NIMGPAGE && (mem = img->page[i]) != 0){
+    kref(mem);
+    releasesleep(&img->lock);
+    *pp = mem;
+    return 0;
+  }
+  if((mem = kalloc()) == 0){
+    releasesleep(&img->lock);
+    return 1;
+  }
+  n = s->filesz - (va - s->va);
+  if(n > PGSIZE)
+    n = PGSIZE;
+  memset(mem + n, 0, PGSIZE - n);
+  ilock(img->ip);
+  if(readi(img->ip, mem, s->off + (va - s->va), n) != n){
+    iunlock(img->ip);
+    releasesleep(&img->lock);
+    kfree(mem);
+    return -1;
+  }
+  iunlock(img->ip);
+  // Pages past the index are simply private to the caller.
+  if(i < NIMGPAGE){
+    img->page[i] = mem;
+    kref(mem);
+  }
+  releasesleep(&img->lock);
+  *pp = mem;
+  return 0;
+}
@@ -0,0 +1,33 @@
+// An executable that one or more processes are running.
+// exec() records where the program's loadable segments go
+// and pagefault() reads each page in on first touch.  Pages
+// that come from the file are kept here and mapped
+// read-only, copy-on-write, into every process that
+// touches them.  When the last process exits the image
+// stays cached, pages and all, until it is evicted or the
+// file changes.
+
+#define NIMGSEG  4                         // loadable segments per image
+#define NIMGPAGE (PGSIZE / sizeof(char*))  // shared pages per image
+
+struct imgseg {
+  uint va;      // first address, page-aligned
+  uint memsz;   // bytes in memory
+  uint off;     // file offset of va
+  uint filesz;  // bytes that come from the file
+};
+
+struct image {
+  uint dev;            // Device number
+  uint inum;           // Inode number
+  int ref;             // Processes running this image
+  struct inode *ip;    // The executable, or 0 if the slot is free
+  int stale;           // File changed: never hand out again
+  uint lastuse;        // When ref last dropped to 0, for LRU
+  struct sleeplock lock; // protects page[] while reading one in
+  uint entry;          // Program entry point
+  uint sz;             // End of the last segment
+  int nseg;
+  struct imgseg seg[NIMGSEG];
+  char **page;         // Pages read in so far, indexed by va/PGSIZE
+};
@@ -1,6 +1,10 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers.  A buddy allocator: it hands out blocks
+// of 2^order contiguous pages, aligned to their size, for
+// orders up to MAXORDER.  kalloc() and kfree() deal in
+// single pages.  kzalloc() hands out pages zeroed ahead of
+// time by idle CPUs.
 
 #include "types.h"
 #include "defs.h"
@@ -8,19 +12,43 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "memstat.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
 
+// A free block, on the list for its order.
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
+#define SPGORDER 10   // a superpage is 2^10 pages
+#define FREEBLK 0x80  // in order[]: first page of a free block
+
+// free[i] heads a circular list of the free blocks of 2^i
+// pages.  order[] marks the first page of each free block
+// with FREEBLK|i, which is how kfree() finds out whether a
+// block's buddy is free to merge with.
+// ref counts the page tables and other holders sharing each
+// allocated page; kfree only frees a page when the last one
+// lets go.
+// zeroed holds pages an idle CPU has already cleared, for
+// kzalloc(); kalloc() falls back on them once the free lists
+// run dry.
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run free[MAXORDER+1];
+  uint nblock[MAXORDER+1];    // blocks on free[i]
+  int nfree;                  // pages on the free lists
+  int npage;                  // pages ever freed into the allocator
+  uchar order[PHYSTOP/PGSIZE];
+  ushort ref[PHYSTOP/PGSIZE];
+  struct run *zeroed;
+  int nzeroed;
+  char *zero;  // shared page of zeros; never freed
 } kmem;
 
 // Initialization happens in two phases.
@@ -31,8 +59,12 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
+  for(i = 0; i <= MAXORDER; i++)
+    kmem.free[i].next = kmem.free[i].prev = &kmem.free[i];
   freerange(vstart, vend);
 }
 
@@ -41,6 +73,9 @@ kinit2(void *vstart, void *vend)
 {
   freerange(vstart, vend);
   kmem.use_lock = 1;
+  if((kmem.zero = kalloc()) == 0)
+    panic("kinit2");
+  memset(kmem.zero, 0, PGSIZE);
 }
 
 void
@@ -48,30 +83,116 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    kmem.npage++;
     kfree(p);
+  }
+}
+
+static void
+pushfree(char *v, int order)
+{
+  struct run *r, *h;
+
+  r = (struct run*)v;
+  h = &kmem.free[order];
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.order[V2P(v)/PGSIZE] = FREEBLK | order;
+  kmem.nblock[order]++;
+  kmem.nfree += 1 << order;
+}
+
+static void
+popfree(struct run *r, int order)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.order[V2P(r)/PGSIZE] = 0;
+  kmem.nblock[order]--;
+  kmem.nfree -= 1 << order;
+}
+
+// Put the block at v back on the free lists, merged with
+// its buddy for as long as the buddy is free as a whole.
+// Caller holds kmem.lock.
+static void
+freeblock(char *v, int order)
+{
+  uint pa, buddy;
+
+  pa = V2P(v);
+  while(order < MAXORDER){
+    buddy = pa ^ (PGSIZE << order);
+    if(buddy >= PHYSTOP || kmem.order[buddy/PGSIZE] != (FREEBLK | order))
+      break;
+    popfree((struct run*)P2V(buddy), order);
+    pa &= ~(PGSIZE << order);
+    order++;
+  }
+  pushfree(P2V(pa), order);
 }
+
+// Take a free block of 2^order pages, splitting the
+// smallest larger one if there is none that size.
+// Caller holds kmem.lock.
+static char*
+allocblock(int order)
+{
+  struct run *r;
+  int o;
+
+  for(o = order; o <= MAXORDER; o++)
+    if(kmem.free[o].next != &kmem.free[o])
+      break;
+  if(o > MAXORDER)
+    return 0;
+  r = kmem.free[o].next;
+  popfree(r, o);
+  // Hand back the upper halves.
+  while(o > order){
+    o--;
+    pushfree((char*)r + (PGSIZE << o), o);
+  }
+  return (char*)r;
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// If the page is shared, just drop one reference.
 void
 kfree(char *v)
 {
-  struct run *r;
-
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
+  if(v == kmem.zero)
+    return;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(kmem.ref[V2P(v)/PGSIZE] > 1){
+    kmem.ref[V2P(v)/PGSIZE]--;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return;
+  }
+  kmem.ref[V2P(v)/PGSIZE] = 0;
+#ifdef KDEBUG
+  if(kmem.use_lock)
+    release(&kmem.lock);
 
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+#endif
+  freeblock(v, 0);
   if(kmem.use_lock)
     release(&kmem.lock);
 }
@@ -81,16 +202,198 @@ kfree(char *v)
 // Returns 0 if the memory cannot be allocated.
 char*
 kalloc(void)
+{
+  return kallocn(0);
+}
+
+// Allocate one page of zeros.
+// Returns 0 if the memory cannot be allocated.
+char*
+kzalloc(void)
 {
   struct run *r;
 
+  r = 0;
+  // Before kinit2() the pool is empty, and acquire() would
+  // call mycpu() before mpinit() has found the CPUs.
+  if(kmem.use_lock){
+    acquire(&kmem.lock);
+    if((r = kmem.zeroed) != 0){
+      kmem.zeroed = r->next;
+      kmem.nzeroed--;
+      kmem.ref[V2P(r)/PGSIZE] = 1;
+    }
+    release(&kmem.lock);
+  }
+  if(r){
+    r->next = 0;
+    return (char*)r;
+  }
+  if((r = (struct run*)kalloc()) != 0)
+    memset(r, 0, PGSIZE);
+  return (char*)r;
+}
+
+// Called by the scheduler when it finds nothing to run:
+// clear one free page for kzalloc(), if the pool is short.
+void
+kzerofill(void)
+{
+  struct run *r;
+
+  if(kmem.nzeroed >= NZEROPG || kfreecount() < KSWAPLOW)
+    return;
+  acquire(&kmem.lock);
+  r = (struct run*)allocblock(0);
+  release(&kmem.lock);
+  if(r == 0)
+    return;
+  memset(r, 0, PGSIZE);
+  acquire(&kmem.lock);
+  // The list link is the only non-zero word; kzalloc()
+  // clears it.
+  r->next = kmem.zeroed;
+  kmem.zeroed = r;
+  kmem.nzeroed++;
+  release(&kmem.lock);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size.  Returns 0 if there is no such block.
+char*
+kallocn(int order)
+{
+  char *v;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  if((v = allocblock(order)) == 0 && order == 0 && kmem.zeroed){
+    v = (char*)kmem.zeroed;
+    kmem.zeroed = kmem.zeroed->next;
+    kmem.nzeroed--;
+  }
+  if(v)
+    kmem.ref[V2P(v)/PGSIZE] = 1;
   if(kmem.use_lock)
     release(&kmem.lock);
-  return (char*)r;
+  return v;
+}
+
+// Free a block from kallocn(order).
+void
+kfreen(char *v, int order)
+{
+  if(order == 0){
+    kfree(v);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || (uint)v % (PGSIZE << order) ||
+     v < end || V2P(v) + (PGSIZE << order) > PHYSTOP)
+    panic("kfreen");
+  acquire(&kmem.lock);
+  if(kmem.ref[V2P(v)/PGSIZE] != 1)
+    panic("kfreen: shared");
+  kmem.ref[V2P(v)/PGSIZE] = 0;
+#ifdef KDEBUG
+  release(&kmem.lock);
+
+  memset(v, 1, PGSIZE << order);
+
+  acquire(&kmem.lock);
+#endif
+  freeblock(v, order);
+  release(&kmem.lock);
 }
 
+// Add a reference to the allocated page v, which is
+// then freed by one more kfree().
+void
+kref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kref");
+  if(v == kmem.zero)
+    return;
+  acquire(&kmem.lock);
+  if(kmem.ref[V2P(v)/PGSIZE] < 1)
+    panic("kref: free page");
+  kmem.ref[V2P(v)/PGSIZE]++;
+  release(&kmem.lock);
+}
+
+// Return the number of references to page v.
+// The zero page is never counted, so it is never
+// the sole reference.
+int
+krefcnt(char *v)
+{
+  if(v == kmem.zero)
+    return 2;
+  return kmem.ref[V2P(v)/PGSIZE];
+}
+
+// Return the shared page of zeros.  It may be mapped
+// read-only anywhere; kref() and kfree() ignore it.
+char*
+kzeropage(void)
+{
+  return kmem.zero;
+}
+
+// Number of free pages, for kswapd's watermarks.  Only a
+// snapshot: it may change as soon as it is returned.
+int
+kfreecount(void)
+{
+  return kmem.nfree + kmem.nzeroed;
+}
+
+// Fill in *st from the free lists.
+void
+kmemstat(struct memstat *st)
+{
+  int i;
+
+  acquire(&kmem.lock);
+  st->total = kmem.npage;
+  st->free = kmem.nfree;
+  st->zeroed = kmem.nzeroed;
+  for(i = 0; i <= MAXORDER; i++)
+    st->nblock[i] = kmem.nblock[i];
+  release(&kmem.lock);
+}
+
+// Allocate one 4MB superpage, aligned to 4MB.  Returns 0
+// if there is none, or if taking one would leave memory
+// short: superpages cannot be swapped out.
+char*
+ksuperalloc(void)
+{
+  if(kfreecount() < KSWAPHIGH + NPTENTRIES)
+    return 0;
+  return kallocn(SPGORDER);
+}
+
+// Free a superpage from ksuperalloc().
+void
+ksuperfree(char *v)
+{
+  kfreen(v, SPGORDER);
+}
+
+// Turn superpage v into 1024 ordinary pages, each with one
+// reference, to be freed one at a time with kfree().
+void
+ksplit(char *v)
+{
+  int i;
+
+  if((uint)v % SPGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("ksplit");
+  acquire(&kmem.lock);
+  for(i = 0; i < NPTENTRIES; i++)
+    kmem.ref[V2P(v)/PGSIZE + i] = 1;
+  release(&kmem.lock);
+}
@@ -51,6 +51,62 @@ lapicw(int index, int value)
   lapic[ID];  // wait for write to finish, by reading
 }
 
+// The 8253 timer's channel 2, used once to time 10ms.
+#define PITHZ   1193182
+#define PITCTL  0x43
+#define PIT2    0x42
+#define PITGATE 0x61   // bit 0: gate; bit 5: output
+
+// Clock rates, measured at boot against the 8253.
+static uint tickcount;   // lapic timer counts per tick (10ms)
+static uint tscmult;     // ns per TSC cycle, times 2^24
+static uint64 tsc0;      // TSC at calibration
+
+// n / d, for a quotient that fits in 32 bits, without the
+// 64-bit division the kernel has no libgcc for.
+static uint
+div64(uint64 n, uint d, uint *rem)
+{
+  uint q, r;
+
+  asm("divl %4" : "=a" (q), "=d" (r)
+      : "0" ((uint)n), "1" ((uint)(n >> 32)), "rm" (d));
+  if(rem)
+    *rem = r;
+  return q;
+}
+
+// Time 10ms on the 8253 and count lapic timer and TSC
+// cycles meanwhile.  Falls back on guesses if the 8253
+// never finishes.
+static void
+calibrate(void)
+{
+  uint64 t;
+  uint i, cycles;
+
+  lapicw(TDCR, X1);
+  lapicw(TIMER, MASKED);
+  lapicw(TICR, 0xFFFFFFFF);
+  outb(PITGATE, (inb(PITGATE) & ~0x02) | 0x01);
+  outb(PITCTL, 0xB0);   // channel 2, mode 0, binary
+  outb(PIT2, (PITHZ/100) & 0xFF);
+  outb(PIT2, (PITHZ/100) >> 8);
+  t = rdtsc();
+  for(i = 0; i < 100000000 && !(inb(PITGATE) & 0x20); i++)
+    ;
+  cycles = rdtsc() - t;
+  tickcount = 0xFFFFFFFF - lapic[TCCR];
+  // div64() below needs cycles > 2^24 * 10^7 / 2^32.
+  if(i == 100000000 || tickcount == 0 || cycles < 100000){
+    tickcount = 10000000;
+    cycles = 10000000;
+  }
+  // 10ms is 10^7 ns.
+  tscmult = div64((uint64)10000000 << 24, cycles, 0);
+  tsc0 = rdtsc();
+}
+
 void
 lapicinit(void)
 {
@@ -61,12 +117,13 @@ lapicinit(void)
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
   // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If xv6 cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // from lapic[TICR] and then issues an interrupt, every
+  // 10ms as timed by calibrate() on the first CPU.
+  if(tickcount == 0)
+    calibrate();
   lapicw(TDCR, X1);
   lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  lapicw(TICR, tickcount);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -113,6 +170,44 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// Send interrupt vector to the CPU with the given APIC ID.
+void
+lapicipi(uchar apicid, int vector)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
+// Stop this CPU's timer interrupts, or start them again.
+// A CPU other than the first has no use for them while it
+// has nothing to run.
+void
+lapictimer(int on)
+{
+  if(lapic)
+    lapicw(TICR, on ? tickcount : 0);
+}
+
+// Nanoseconds since boot, from the TSC.
+uint64
+nsectime(void)
+{
+  uint64 d;
+
+  d = rdtsc() - tsc0;
+  return ((uint64)(uint)(d >> 32) * tscmult << 8) +
+         ((uint64)(uint)d * tscmult >> 24);
+}
+
+// Time since boot in seconds and nanoseconds.
+void
+clocktime(struct timespec *ts)
+{
+  ts->sec = div64(nsectime(), 1000000000, &ts->nsec);
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
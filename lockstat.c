@@ -0,0 +1,51 @@
+// Print spin lock statistics, the locks waited on longest
+// first.  With a command, run it and print only what the
+// locks did while it ran.
+
+#include "types.h"
+#include "user.h"
+#include "lockstat.h"
+
+struct lockstat before[NLOCKSTAT], after[NLOCKSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  struct lockstat t;
+  int i, j, n, m;
+
+  m = 0;
+  if(argc > 1){
+    m = lockstat(before, NLOCKSTAT);
+    if(fork() == 0){
+      exec(argv[1], argv + 1);
+      printf(2, "lockstat: exec %s failed\n", argv[1]);
+      exit();
+    }
+    wait();
+  }
+  if((n = lockstat(after, NLOCKSTAT)) < 0){
+    printf(2, "lockstat: failed\n");
+    exit();
+  }
+
+  // Entries are never removed, so before[i] is after[i].
+  for(i = 0; i < m; i++){
+    after[i].nacquire -= before[i].nacquire;
+    after[i].ncontend -= before[i].ncontend;
+    after[i].spin -= before[i].spin;
+  }
+  for(i = 1; i < n; i++){
+    t = after[i];
+    for(j = i; j > 0 && after[j-1].spin < t.spin; j--)
+      after[j] = after[j-1];
+    after[j] = t;
+  }
+
+  printf(1, "lock acquired contended kcycles\n");
+  for(i = 0; i < n; i++)
+    if(after[i].nacquire > 0)
+      printf(1, "%s %d %d %d\n", after[i].name, after[i].nacquire,
+             after[i].ncontend, (uint)(after[i].spin >> 10));
+  exit();
+}
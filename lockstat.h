@@ -0,0 +1,11 @@
+// Spin lock statistics, returned by lockstat().
+// Locks with the same name share one entry.
+
+#define NLOCKSTAT 64  // most lock names counted
+
+struct lockstat {
+  char name[16];
+  uint nacquire;     // acquisitions
+  uint ncontend;     // acquisitions that had to wait
+  uint64 spin;       // TSC cycles spent waiting
+};
@@ -27,13 +27,19 @@ main(void)
   consoleinit();   // console hardware
   uartinit();      // serial port
   pinit();         // process table
+  rcuinit();       // deferred frees
   tvinit();        // trap vectors
   binit();         // buffer cache
+  icacheinit();    // inode cache
   fileinit();      // file table
+  pipeinit();      // pipe cache
+  imginit();       // executable images
+  pollinit();      // poll wait queues
   ideinit();       // disk 
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
   userinit();      // first user process
+  swapinit();      // kswapd
   mpmain();        // finish this processor's setup
 }
 
@@ -81,7 +87,7 @@ startothers(void)
     // Tell entryother.S what stack to use, where to enter, and what
     // pgdir to use. We cannot use kpgdir yet, because the AP processor
     // is running in low  memory, so we use entrypgdir for the APs too.
-    stack = kalloc();
+    stack = kallocn(KSTACKORDER);
     *(void**)(code-4) = stack + KSTACKSIZE;
     *(void(**)(void))(code-8) = mpenter;
     *(int**)(code-12) = (void *) V2P(entrypgdir);
@@ -0,0 +1,119 @@
+// Time the library's memory and string routines against
+// plain byte loops, and the kernel's copies through a pipe.
+// Prints the microseconds taken by each.
+
+#include "types.h"
+#include "user.h"
+#include "date.h"
+
+#define N     8192
+#define ITERS 2000
+
+char src[N + 8], dst[N + 8];
+
+static void*
+bytemove(void *vdst, const void *vsrc, int n)
+{
+  char *d = vdst;
+  const char *s = vsrc;
+
+  while(n-- > 0)
+    *d++ = *s++;
+  return vdst;
+}
+
+static void*
+byteset(void *vdst, int c, uint n)
+{
+  char *d = vdst;
+
+  while(n-- > 0)
+    *d++ = c;
+  return vdst;
+}
+
+static uint
+bytelen(const char *s)
+{
+  int n;
+
+  for(n = 0; s[n]; n++)
+    ;
+  return n;
+}
+
+// Microseconds since boot; wraps, but differences are good.
+static uint
+usec(void)
+{
+  struct timespec ts;
+
+  clocktime(&ts);
+  return ts.sec * 1000000 + ts.nsec / 1000;
+}
+
+static void
+report(char *what, uint t0, uint t1)
+{
+  printf(1, "%s: %d us\n", what, t1 - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, fds[2], pid;
+  uint t;
+
+  memset(src, 'x', sizeof(src));
+  src[N] = 0;
+
+  t = usec();
+  for(i = 0; i < ITERS; i++)
+    bytemove(dst, src, N);
+  report("byte copy", t, usec());
+  t = usec();
+  for(i = 0; i < ITERS; i++)
+    memmove(dst, src, N);
+  report("memmove", t, usec());
+  t = usec();
+  for(i = 0; i < ITERS; i++)
+    memmove(dst + 1, src + 3, N);
+  report("memmove, misaligned", t, usec());
+
+  t = usec();
+  for(i = 0; i < ITERS; i++)
+    byteset(dst, i, N);
+  report("byte fill", t, usec());
+  t = usec();
+  for(i = 0; i < ITERS; i++)
+    memset(dst, i, N);
+  report("memset", t, usec());
+
+  t = usec();
+  for(i = 0; i < ITERS; i++)
+    bytelen(src);
+  report("byte strlen", t, usec());
+  t = usec();
+  for(i = 0; i < ITERS; i++)
+    strlen(src);
+  report("strlen", t, usec());
+
+  // A pipe copies each byte twice in the kernel.
+  if(pipe(fds) < 0){
+    printf(2, "membench: pipe failed\n");
+    exit();
+  }
+  t = usec();
+  if((pid = fork()) == 0){
+    close(fds[0]);
+    for(i = 0; i < ITERS; i++)
+      write(fds[1], src, N/2);
+    exit();
+  }
+  close(fds[1]);
+  while(read(fds[0], dst, N) > 0)
+    ;
+  wait();
+  report("pipe", t, usec());
+  exit();
+}
@@ -0,0 +1,21 @@
+// Print free physical memory, by buddy allocator order.
+
+#include "types.h"
+#include "user.h"
+#include "memstat.h"
+
+int
+main(void)
+{
+  struct memstat st;
+  int i;
+
+  if(memstat(&st) < 0){
+    printf(2, "memstat: failed\n");
+    exit();
+  }
+  printf(1, "%d of %d pages free, %d more zeroed\n", st.free, st.total, st.zeroed);
+  for(i = 0; i <= MAXORDER; i++)
+    printf(1, "order %d (%d KB): %d free\n", i, 4 << i, st.nblock[i]);
+  exit();
+}
@@ -0,0 +1,10 @@
+// Physical memory statistics, returned by memstat().
+
+#define MAXORDER 10  // largest kallocn() block: 2^10 pages, 4MB
+
+struct memstat {
+  uint total;                 // pages managed by the allocator
+  uint free;                  // pages free
+  uint zeroed;                // more free pages, already zeroed
+  uint nblock[MAXORDER+1];    // free blocks of 2^i pages
+};
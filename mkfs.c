@@ -260,7 +260,7 @@ iappend(uint inum, void *xp, int n)
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, i1, i2;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -273,7 +273,7 @@ iappend(uint inum, void *xp, int n)
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
@@ -283,6 +283,25 @@ iappend(uint inum, void *xp, int n)
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
+    } else {
+      // doubly-indirect, laid out as bmap() expects
+      i1 = (fbn - NDIRECT - NINDIRECT) / NINDIRECT;
+      i2 = (fbn - NDIRECT - NINDIRECT) % NINDIRECT;
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
+      }
+      rsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      if(indirect[i1] == 0){
+        indirect[i1] = xint(freeblock++);
+        wsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      }
+      x = xint(indirect[i1]);
+      rsect(x, (char*)indirect);
+      if(indirect[i2] == 0){
+        indirect[i2] = xint(freeblock++);
+        wsect(x, (char*)indirect);
+      }
+      x = xint(indirect[i2]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -83,6 +83,7 @@ struct segdesc {
 #define NPDENTRIES      1024    // # directory entries per page directory
 #define NPTENTRIES      1024    // # PTEs per page table
 #define PGSIZE          4096    // bytes mapped by a page
+#define SPGSIZE         (PGSIZE*NPTENTRIES) // bytes mapped by a 4MB superpage
 
 #define PTXSHIFT        12      // offset of PTX in a linear address
 #define PDXSHIFT        22      // offset of PDX in a linear address
@@ -94,7 +95,15 @@ struct segdesc {
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
+#define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_COW         0x200   // Copy on write (software bit)
+#define PTE_SWAP        0x400   // Not present: page is in swap (software bit)
+
+// Swap slot of a PTE_SWAP entry, and the entry for slot
+#define SWAPSLOT(pte)   ((uint)(pte) >> PTXSHIFT)
+#define SWAPPTE(slot)   (((uint)(slot) << PTXSHIFT) | PTE_SWAP)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
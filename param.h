@@ -1,15 +1,26 @@
 #define NPROC        64  // maximum number of processes
-#define KSTACKSIZE 4096  // size of per-process kernel stack
+#define KSTACKSIZE 8192  // size of per-process kernel stack
+#define KSTACKORDER   1  // KSTACKSIZE is 2^KSTACKORDER pages
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NOFILE       16  // open files per process before the table grows
+#define NOFILEMAX  1024  // most open files per process (a page of pointers)
+#define NIMAGE       64  // maximum number of executables in use
+#define NIMGCACHE     8  // executables kept cached after their last exit
 #define NDEV         10  // maximum major device number
+#define PIPEMAX   65536  // largest pipe buffer, in bytes
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define FAULTAROUND   8  // heap pages filled per fault when growing in order
+#define TLBINVLPG    32  // most pages flushed one by one; more reload %cr3
+#define KSWAPLOW    256  // kswapd starts reclaiming below this many free pages
+#define KSWAPHIGH  1024  // and stops once this many are free
+#define NSWAPPG    1024  // pages of swap space on the boot disk
+#define SWAPBATCH    32  // pages evicted or unmapped between TLB flushes
+#define NZEROPG     128  // free pages kept zeroed for kzalloc()
+#define NRCU        128  // frees waiting for RCU readers to finish
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (MAXOPBLOCKS*3)  // disk blocks cached before buffers are reused
 #define FSSIZE       20000  // size of file system in blocks
 
 #define MAX_MMAP_CTX  16 // maximum mmaped areas in a system
@@ -7,18 +7,101 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "poll.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+#define PIPESIZE PGSIZE                 // default ring size
 
+// The ring is one physically contiguous block from
+// kallocn().  size is always a power of two so that nread
+// and nwrite may wrap around without disturbing
+// nwrite % size.
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;
+  uint size;      // ring size in bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rwait;      // readers asleep in piperead
+  int wwait;      // writers asleep waiting for room
+  uint wneed;     // least room any sleeping writer needs
+  struct pollq pq; // processes in poll()
 };
 
+static struct kmcache pipecache;
+
+void
+pipeinit(void)
+{
+  kminit(&pipecache, "pipe", sizeof(struct pipe));
+}
+
+// The kallocn() order of a ring of size bytes.
+static int
+pipeorder(uint size)
+{
+  int order;
+
+  for(order = 0; (PGSIZE << order) < size; order++)
+    ;
+  return order;
+}
+
+// Copy n bytes from addr into the ring at nwrite.
+// The copy is split only at the wraparound point.
+static void
+pipecopyin(struct pipe *p, char *addr, uint n)
+{
+  uint off, m;
+
+  while(n > 0){
+    off = p->nwrite % p->size;
+    m = p->size - off;
+    if(m > n)
+      m = n;
+    memmove(p->data + off, addr, m);
+    p->nwrite += m;
+    addr += m;
+    n -= m;
+  }
+}
+
+// Copy n bytes out of the ring at nread into addr.
+static void
+pipecopyout(struct pipe *p, char *addr, uint n)
+{
+  uint off, m;
+
+  while(n > 0){
+    off = p->nread % p->size;
+    m = p->size - off;
+    if(m > n)
+      m = n;
+    memmove(addr, p->data + off, m);
+    p->nread += m;
+    addr += m;
+    n -= m;
+  }
+}
+
+// Sleep until there is room in the ring.  Readers only
+// wake a writer once half the ring (or all the writer
+// still needs) is free, not after every read.
+static void
+pipesleepw(struct pipe *p, uint need)
+{
+  if(p->rwait)
+    wakeup(&p->nread);
+  pollwakeup(&p->pq);
+  if(p->wwait == 0 || need < p->wneed)
+    p->wneed = need;
+  p->wwait++;
+  sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+  p->wwait--;
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +111,19 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((p = (struct pipe*)kalloc()) == 0)
+  if((p = kmalloc(&pipecache)) == 0)
     goto bad;
+  if((p->data = kallocn(pipeorder(PIPESIZE))) == 0)
+    goto bad;
+  p->size = PIPESIZE;
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
   p->nread = 0;
+  p->rwait = 0;
+  p->wwait = 0;
+  p->wneed = 0;
+  p->pq.head = 0;
   initlock(&p->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -48,7 +138,7 @@ pipealloc(struct file **f0, struct file **f1)
 //PAGEBREAK: 20
  bad:
   if(p)
-    kfree((char*)p);
+    kmfree(&pipecache, p);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -67,55 +157,205 @@ pipeclose(struct pipe *p, int writable)
     p->readopen = 0;
     wakeup(&p->nwrite);
   }
+  pollwakeup(&p->pq);
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
-    kfree((char*)p);
+    kfreen(p->data, pipeorder(p->size));
+    kmfree(&pipecache, p);
   } else
     release(&p->lock);
 }
 
+// Change the ring size of p to n bytes, rounded up to a
+// power-of-two number of pages.  Fails if the data
+// already in the pipe would not fit, or if there is no
+// contiguous block that large.
+// Returns the new size; n == 0 just reports the size.
+int
+piperesize(struct pipe *p, int n)
+{
+  char *data, *old;
+  uint size, oldsize, cnt;
+
+  if(n == 0)
+    return p->size;
+  if(n < 0 || n > PIPEMAX)
+    return -1;
+  for(size = PGSIZE; size < n; size <<= 1)
+    ;
+  if((data = kallocn(pipeorder(size))) == 0)
+    return -1;
+
+  acquire(&p->lock);
+  cnt = p->nwrite - p->nread;
+  if(cnt > size){
+    release(&p->lock);
+    kfreen(data, pipeorder(size));
+    return -1;
+  }
+  // Unwrap the current contents to the start of the new ring.
+  pipecopyout(p, data, cnt);
+  old = p->data;
+  oldsize = p->size;
+  p->data = data;
+  p->size = size;
+  p->nread = 0;
+  p->nwrite = cnt;
+  if(p->wwait)
+    wakeup(&p->nwrite);
+  pollwakeup(&p->pq);
+  release(&p->lock);
+
+  kfreen(old, pipeorder(oldsize));
+  return size;
+}
+
 //PAGEBREAK: 40
+// The copies in and out of addr happen under p->lock, so
+// before each one the part of addr it covers is faulted in
+// with the lock dropped, and the pipe looked at again.
 int
 pipewrite(struct pipe *p, char *addr, int n)
 {
   int i;
+  uint m, ready;
 
+  ready = 0;   // addr[0..ready) has been faulted in
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
+  for(i = 0; i < n; i += m){
+    while(p->nwrite == p->nread + p->size){  //DOC: pipewrite-full
       if(p->readopen == 0 || myproc()->killed){
         release(&p->lock);
         return -1;
       }
-      wakeup(&p->nread);
-      sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+      pipesleepw(p, n - i);
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    m = p->nread + p->size - p->nwrite;
+    if(m > n - i)
+      m = n - i;
+    if(i + m > ready){
+      release(&p->lock);
+      if(prefault((uint)addr + i, m, 0) < 0)
+        return -1;
+      ready = i + m;
+      acquire(&p->lock);
+      m = 0;
+      continue;
+    }
+    pipecopyin(p, addr + i, m);
   }
-  wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  if(p->rwait)
+    wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  pollwakeup(&p->pq);
   release(&p->lock);
   return n;
 }
 
+// Wait until p has room for more data, without holding
+// any buffer.  Returns 0 once there is space, -1 if the
+// read end has been closed or the caller was killed.
 int
-piperead(struct pipe *p, char *addr, int n)
+pipewait(struct pipe *p)
 {
-  int i;
-
   acquire(&p->lock);
-  while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
-    if(myproc()->killed){
+  while(p->nwrite == p->nread + p->size){
+    if(p->readopen == 0 || myproc()->killed){
       release(&p->lock);
       return -1;
     }
-    sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+    pipesleepw(p, 1);
+  }
+  if(p->readopen == 0){
+    release(&p->lock);
+    return -1;
+  }
+  release(&p->lock);
+  return 0;
+}
+
+// Copy as much of addr[0..n) into p as fits right now.
+// Never sleeps, so the caller may hold a buffer cache
+// block while copying straight out of it.
+// Returns the number of bytes copied, -1 if nobody reads.
+int
+pipeput(struct pipe *p, char *addr, int n)
+{
+  uint m;
+
+  acquire(&p->lock);
+  if(p->readopen == 0){
+    release(&p->lock);
+    return -1;
+  }
+  m = p->nread + p->size - p->nwrite;
+  if(m > n)
+    m = n;
+  pipecopyin(p, addr, m);
+  if(m > 0){
+    if(p->rwait)
+      wakeup(&p->nread);
+    pollwakeup(&p->pq);
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
+  release(&p->lock);
+  return m;
+}
+
+int
+piperead(struct pipe *p, char *addr, int n)
+{
+  uint m, room, ready;
+
+  ready = 0;
+  acquire(&p->lock);
+  for(;;){
+    while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
+      if(myproc()->killed){
+        release(&p->lock);
+        return -1;
+      }
+      p->rwait++;
+      sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+      p->rwait--;
+    }
+    m = p->nwrite - p->nread;  //DOC: piperead-copy
+    if(m > n)
+      m = n;
+    if(m <= ready)
       break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+    release(&p->lock);
+    if(prefault((uint)addr, m, 1) < 0)
+      return -1;
+    ready = m;
+    acquire(&p->lock);
   }
-  wakeup(&p->nwrite);  //DOC: piperead-wakeup
+  pipecopyout(p, addr, m);
+  room = p->nread + p->size - p->nwrite;
+  if(p->wwait && (room >= p->size/2 || room >= p->wneed))
+    wakeup(&p->nwrite);  //DOC: piperead-wakeup
+  if(m > 0)
+    pollwakeup(&p->pq);
+  release(&p->lock);
+  return m;
+}
+
+// Report poll events for p and queue pe on it.
+// End of file counts as readable.
+int
+pipepoll(struct pipe *p, struct pollent *pe)
+{
+  int r;
+
+  r = 0;
+  acquire(&p->lock);
+  pollwait(&p->pq, pe);
+  if(p->nread != p->nwrite || p->writeopen == 0)
+    r |= POLLIN;
+  if(p->writeopen == 0)
+    r |= POLLHUP;
+  if(p->nwrite != p->nread + p->size)
+    r |= POLLOUT;
+  if(p->readopen == 0)
+    r |= POLLERR;
   release(&p->lock);
-  return i;
+  return r;
 }
@@ -0,0 +1,175 @@
+// Waiting for events on several descriptors at once.
+//
+// Objects that a reader or writer can block on (pipes, the
+// console) embed a pollq.  poll() hangs one pollent per
+// descriptor on those queues and sleeps on a pollwaiter of
+// its own; an object calls pollwakeup() whenever its state
+// changes.  polllock protects every queue and the woken
+// flags, so an event that arrives between the scan and the
+// sleep is not lost.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "poll.h"
+
+struct pollwaiter {
+  int woken;
+};
+
+static struct spinlock polllock;
+static struct pollq tickq;  // pollers with a timeout
+
+void
+pollinit(void)
+{
+  initlock(&polllock, "poll");
+}
+
+// Hang pe on q unless it is queued already.
+// The caller holds the lock of the object owning q.
+void
+pollwait(struct pollq *q, struct pollent *pe)
+{
+  if(pe == 0 || pe->q)
+    return;
+  acquire(&polllock);
+  pe->q = q;
+  pe->next = q->head;
+  q->head = pe;
+  release(&polllock);
+}
+
+// Wake every poller waiting on q.  The caller holds the
+// lock of the object owning q, which is what makes the
+// unlocked look at q->head safe: a poller queues itself
+// under that same lock before it checks the object.
+void
+pollwakeup(struct pollq *q)
+{
+  struct pollent *pe;
+
+  if(q->head == 0)
+    return;
+  acquire(&polllock);
+  for(pe = q->head; pe; pe = pe->next){
+    if(pe->w->woken == 0){
+      pe->w->woken = 1;
+      wakeup(pe->w);
+    }
+  }
+  release(&polllock);
+}
+
+// Called on every clock tick so that pollers with a
+// timeout can look at the time.  A poller that queues
+// itself just after the check is picked up next tick.
+void
+polltick(void)
+{
+  pollwakeup(&tickq);
+}
+
+static void
+pollremove(struct pollent *pe)
+{
+  struct pollent **pp;
+
+  if(pe->q == 0)
+    return;
+  for(pp = &pe->q->head; *pp; pp = &(*pp)->next){
+    if(*pp == pe){
+      *pp = pe->next;
+      break;
+    }
+  }
+  pe->q = 0;
+}
+
+//PAGEBREAK!
+// Wait until one of fds[0..nfds) is ready or timeout
+// clock ticks have passed (forever if timeout < 0).
+// Fills in revents and returns the number of ready
+// descriptors, 0 on timeout.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+  struct pollent pe0[NOFILE+1], *pe;
+  struct pollwaiter w;
+  struct proc *curproc = myproc();
+  struct file *f;
+  uint ticks0;
+  int i, n;
+
+  // A short list fits on the kernel stack; a long one
+  // takes a page.
+  if(nfds < 0 || nfds >= PGSIZE/sizeof(*pe))
+    return -1;
+  pe = pe0;
+  if(nfds > NOFILE && (pe = (struct pollent*)kalloc()) == 0)
+    return -1;
+  // Hold a reference to each file while its entry may be
+  // queued, so that a thread sharing the descriptor table
+  // cannot close and free it under us.
+  for(i = 0; i <= nfds; i++){
+    pe[i].q = 0;
+    pe[i].w = &w;
+    pe[i].f = 0;
+    if(i < nfds && fds[i].fd >= 0 && fds[i].fd < curproc->nofile &&
+       (f = curproc->ofile[fds[i].fd]) != 0)
+      pe[i].f = filedup(f);
+  }
+
+  ticks0 = ticks;
+  for(;;){
+    acquire(&polllock);
+    w.woken = 0;
+    release(&polllock);
+
+    n = 0;
+    for(i = 0; i < nfds; i++){
+      fds[i].revents = 0;
+      if(fds[i].fd < 0)
+        continue;
+      if(pe[i].f == 0)
+        fds[i].revents = POLLNVAL;
+      else
+        fds[i].revents = filepoll(pe[i].f, &pe[i]) &
+                         (fds[i].events | POLLERR | POLLHUP);
+      if(fds[i].revents)
+        n++;
+    }
+    if(n > 0 || timeout == 0)
+      break;
+    if(timeout > 0 && ticks - ticks0 >= timeout)
+      break;
+    if(curproc->killed){
+      n = -1;
+      break;
+    }
+    if(timeout > 0)
+      pollwait(&tickq, &pe[nfds]);
+
+    acquire(&polllock);
+    while(w.woken == 0 && !curproc->killed)
+      sleep(&w, &polllock);
+    release(&polllock);
+  }
+
+  acquire(&polllock);
+  for(i = 0; i <= nfds; i++)
+    pollremove(&pe[i]);
+  release(&polllock);
+  for(i = 0; i < nfds; i++)
+    if(pe[i].f)
+      fileclose(pe[i].f);
+  if(pe != pe0)
+    kfree((char*)pe);
+  return n;
+}
@@ -0,0 +1,12 @@
+// poll() events, shared by the kernel and user programs.
+#define POLLIN   0x001  // data to read (or end of file)
+#define POLLOUT  0x004  // room to write
+#define POLLERR  0x008  // no reader left on a pipe
+#define POLLHUP  0x010  // no writer left on a pipe
+#define POLLNVAL 0x020  // fd is not open
+
+struct pollfd {
+  int fd;          // descriptor to watch
+  short events;    // events of interest
+  short revents;   // events that happened
+};
@@ -1,15 +1,87 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "x86.h"
+
+// printf() builds its output in a buffer and writes it with
+// one system call.  Output to stdout and stderr is kept until
+// a newline, a full buffer, fflush(), or until the process
+// exits, forks or execs; output to other descriptors is
+// written at the end of each call, since they may be closed
+// and reused at any time.
+
+#define OUTBUF 512
+
+struct outbuf {
+  int fd;
+  int n;
+  int nl;   // holds a newline
+  char buf[OUTBUF];
+};
+
+static struct {
+  uint lock;
+  struct outbuf std[3];
+} out;
+
+extern void (*stdioflush)(void);
 
 static void
-putc(int fd, char c)
+lock(void)
 {
-  write(fd, &c, 1);
+  while(xchg(&out.lock, 1) != 0)
+    yield();
 }
 
 static void
-printint(int fd, int xx, int base, int sgn)
+unlock(void)
+{
+  xchg(&out.lock, 0);
+}
+
+static void
+flush(struct outbuf *b)
+{
+  if(b->n > 0)
+    write(b->fd, b->buf, b->n);
+  b->n = 0;
+  b->nl = 0;
+}
+
+static void
+flushall(void)
+{
+  int i;
+
+  lock();
+  for(i = 0; i < 3; i++)
+    flush(&out.std[i]);
+  unlock();
+}
+
+// Write out what printf() has buffered for fd.
+void
+fflush(int fd)
+{
+  if(fd < 0 || fd >= 3)
+    return;
+  lock();
+  flush(&out.std[fd]);
+  unlock();
+}
+
+static void
+putc(struct outbuf *b, char c)
+{
+  if(b->n == OUTBUF)
+    flush(b);
+  b->buf[b->n++] = c;
+  if(c == '\n')
+    b->nl = 1;
+}
+
+static void
+printint(struct outbuf *b, int xx, int base, int sgn)
 {
   static char digits[] = "0123456789ABCDEF";
   char buf[16];
@@ -32,17 +104,27 @@ printint(int fd, int xx, int base, int sgn)
     buf[i++] = '-';
 
   while(--i >= 0)
-    putc(fd, buf[i]);
+    putc(b, buf[i]);
 }
 
 // Print to the given fd. Only understands %d, %x, %p, %s.
 void
 printf(int fd, const char *fmt, ...)
 {
+  struct outbuf local, *b;
   char *s;
   int c, i, state;
   uint *ap;
 
+  if(fd >= 0 && fd < 3){
+    lock();
+    stdioflush = flushall;
+    b = &out.std[fd];
+  } else {
+    b = &local;
+    b->n = 0;
+  }
+  b->fd = fd;
   state = 0;
   ap = (uint*)(void*)&fmt + 1;
   for(i = 0; fmt[i]; i++){
@@ -51,14 +133,14 @@ printf(int fd, const char *fmt, ...)
       if(c == '%'){
         state = '%';
       } else {
-        putc(fd, c);
+        putc(b, c);
       }
     } else if(state == '%'){
       if(c == 'd'){
-        printint(fd, *ap, 10, 1);
+        printint(b, *ap, 10, 1);
         ap++;
       } else if(c == 'x' || c == 'p'){
-        printint(fd, *ap, 16, 0);
+        printint(b, *ap, 16, 0);
         ap++;
       } else if(c == 's'){
         s = (char*)*ap;
@@ -66,20 +148,27 @@ printf(int fd, const char *fmt, ...)
         if(s == 0)
           s = "(null)";
         while(*s != 0){
-          putc(fd, *s);
+          putc(b, *s);
           s++;
         }
       } else if(c == 'c'){
-        putc(fd, *ap);
+        putc(b, *ap);
         ap++;
       } else if(c == '%'){
-        putc(fd, c);
+        putc(b, c);
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c);
+        putc(b, '%');
+        putc(b, c);
       }
       state = 0;
     }
   }
+  if(b == &local)
+    flush(b);
+  else {
+    if(b->nl)
+      flush(b);
+    unlock();
+  }
 }
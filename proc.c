@@ -9,14 +9,18 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "image.h"
+#include "traps.h"
 
-#ifndef PTE_D
-#define PTE_D 0x040
-#endif
+#define SLEEPQBITS 6
 
+// sleepq holds the SLEEPING processes, hashed by chan, each
+// queue in the order they went to sleep, so that wakeup()
+// looks only at processes that may be sleeping on its chan.
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct proc *sleepq[1<<SLEEPQBITS];
 } ptable;
 
 static struct proc *initproc;
@@ -25,7 +29,9 @@ int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
+static void wakeup1(void *chan, int one);
+static struct proc **sleepq(void *chan);
+static void kickidle(void);
 
 struct spinlock mmap_lock;
 int global_mmap_count = 0;
@@ -102,11 +108,15 @@ found:
   p->ticks = 0;
   p->priority = 0;
   p->time_slice = 4;
+  p->img = 0;
+  p->swapwant = 0;
+  p->swaphand = 0;
+  fdinit(p);
 
   release(&ptable.lock);
 
   // Allocate kernel stack.
-  if((p->kstack = kalloc()) == 0){
+  if((p->kstack = kallocn(KSTACKORDER)) == 0){
     p->state = UNUSED;
     return 0;
   }
@@ -164,38 +174,109 @@ userinit(void)
   acquire(&ptable.lock);
 
   p->state = RUNNABLE;
+  kickidle();
 
   release(&ptable.lock);
 }
 
+// Start a kernel process running fn, which never returns.
+// It has no user memory, only the kernel's mappings.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0 || (p->pgdir = setupkvm()) == 0)
+    panic("kthread");
+  // forkret() returns to fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+  p->parent = initproc;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  kickidle();
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
+// Growth is lazy: pagefault() fills pages in as they are
+// touched.  Shrinking frees the pages at once.  Threads
+// sharing the page table get the new size too.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint sz, oldsz;
+  struct proc *p;
   struct proc *curproc = myproc();
 
-  sz = curproc->sz;
+  sz = oldsz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(sz + n < sz || sz + n >= KERNBASE)
       return -1;
+    sz += n;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(-n > sz)
       return -1;
+    sz += n;
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
+
+  // Shrink every thread first, so none faults the freed
+  // range back in.
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->pgdir == curproc->pgdir && p->state != UNUSED)
+      p->sz = sz;
+  release(&ptable.lock);
+  if(sz < oldsz)
+    deallocuvm(curproc->pgdir, oldsz, sz);
   return 0;
 }
 
+// Number of live processes using page table pgdir.
+int
+pgdirref(pde_t *pgdir)
+{
+  struct proc *p;
+  int n;
+
+  n = 0;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->pgdir == pgdir && p->state != UNUSED && p->state != ZOMBIE)
+      n++;
+  release(&ptable.lock);
+  return n;
+}
+
+// Ask user processes to evict about n pages in all, in
+// proportion to their size.  Each does it in swapself() on
+// its next return to user space.
+void
+askreclaim(int n)
+{
+  struct proc *p;
+  uint total;
+
+  total = 0;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if((p->state == RUNNABLE || p->state == RUNNING || p->state == SLEEPING) && p->sz > 0)
+      total += p->sz / PGSIZE;
+  for(p = ptable.proc; p < &ptable.proc[NPROC] && total > 0; p++)
+    if((p->state == RUNNABLE || p->state == RUNNING || p->state == SLEEPING) && p->sz > 0)
+      p->swapwant = (uint)n * (p->sz / PGSIZE) / total + 1;
+  release(&ptable.lock);
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *curproc = myproc();
 
@@ -213,7 +294,7 @@ fork(void)
 
   // Copy process state from proc.
   if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
+    kfreen(np->kstack, KSTACKORDER);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
@@ -225,10 +306,16 @@ fork(void)
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
+  if(fdcopy(np, curproc) < 0){
+    freevm(np->pgdir);
+    kfreen(np->kstack, KSTACKORDER);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
   np->cwd = idup(curproc->cwd);
+  if(curproc->img)
+    np->img = imgdup(curproc->img);
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -241,12 +328,72 @@ fork(void)
   acquire(&ptable.lock);
 
   np->state = RUNNABLE;
+  kickidle();
 
   release(&ptable.lock);
 
   return pid;
 }
 
+// Create a new process running the program at path with
+// arguments argv, without first copying the caller's address
+// space as fork() does.  The child's descriptor i refers to
+// file f[i], or is closed if f[i] is 0.
+// Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct file **f)
+{
+  int i;
+  uint sz, sp;
+  char *s, *last;
+  pde_t *pgdir;
+  struct image *img;
+  struct proc *np;
+  struct proc *curproc = myproc();
+
+  if((pgdir = execload(path, argv, &img, &sz, &sp)) == 0)
+    return -1;
+  if((np = allocproc()) == 0){
+    freevm(pgdir);
+    imgput(img);
+    return -1;
+  }
+  np->pgdir = pgdir;
+  np->img = img;
+  np->sz = sz;
+  np->parent = curproc;
+  // child process inherits the nice value of the parent process
+  np->nice = curproc->nice;
+  memset(np->tf, 0, sizeof(*np->tf));
+  np->tf->cs = (SEG_UCODE << 3) | DPL_USER;
+  np->tf->ds = (SEG_UDATA << 3) | DPL_USER;
+  np->tf->es = np->tf->ds;
+  np->tf->ss = np->tf->ds;
+  np->tf->eflags = FL_IF;
+  np->tf->esp = sp;
+  np->tf->eip = img->entry;
+
+  for(i = 0; i < 3; i++)
+    if(f[i])
+      np->ofile[i] = filedup(f[i]);
+  np->cwd = idup(curproc->cwd);
+
+  for(last=s=path; *s; s++)
+    if(*s == '/')
+      last = s+1;
+  safestrcpy(np->name, last, sizeof(np->name));
+
+  np->tid = np->pid;
+  np->is_thread = 0;
+
+  acquire(&ptable.lock);
+  np->state = RUNNABLE;
+  kickidle();
+  release(&ptable.lock);
+
+  return np->pid;
+}
+
 int
 clone(void *stack)
 {
@@ -268,13 +415,16 @@ clone(void *stack)
   np->tf->esp = curproc->tf->esp + offset;
   np->tf->ebp = curproc->tf->ebp + offset;
 
-  for(int i=0; i< NOFILE; i++){
-    if(curproc->ofile[i]){
-      np->ofile[i] = filedup(curproc->ofile[i]);
-    }
+  if(fdcopy(np, curproc) < 0){
+    kfreen(np->kstack, KSTACKORDER);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
   }
 
   np->cwd = idup(curproc->cwd);
+  if(curproc->img)
+    np->img = imgdup(curproc->img);
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
   np->tid = np->pid;
@@ -287,6 +437,7 @@ clone(void *stack)
 
   acquire(&ptable.lock);
   np->state = RUNNABLE;
+  kickidle();
   release(&ptable.lock);
 
   return np->tid;
@@ -301,7 +452,6 @@ exit(void)
 {
   struct proc *curproc = myproc();
   struct proc *p = myproc();
-  int fd;
 
   if(curproc == initproc)
     panic("init exiting");
@@ -314,31 +464,31 @@ exit(void)
       }
     }
 
-    // Close all open files.
-    for(fd = 0; fd < NOFILE; fd++){
-      if(curproc->ofile[fd]){
-        fileclose(curproc->ofile[fd]);
-        curproc->ofile[fd] = 0;
-      }
-    }
-
     begin_op();
     iput(curproc->cwd);
     end_op();
     curproc->cwd = 0;
   }
 
+  // Close all open files.  A thread got its own copies
+  // of the descriptors in clone(), so it closes them too.
+  fdcloseall(curproc);
+  if(curproc->img){
+    imgput(curproc->img);
+    curproc->img = 0;
+  }
+
   acquire(&ptable.lock);
 
   // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  wakeup1(curproc->parent, 0);
 
   // Pass abandoned children to init.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == curproc){
       p->parent = initproc;
       if(p->state == ZOMBIE)
-        wakeup1(initproc);
+        wakeup1(initproc, 0);
     }
   }
 
@@ -368,7 +518,7 @@ wait(void)
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
-        kfree(p->kstack);
+        kfreen(p->kstack, KSTACKORDER);
         p->kstack = 0;
         if(p->is_thread == 0){
           freevm(p->pgdir);
@@ -413,7 +563,7 @@ join(void)
 
       if(p->state == ZOMBIE){
         pid = p->tid;
-        kfree(p->kstack);
+        kfreen(p->kstack, KSTACKORDER);
         p->kstack = 0;
 
         p->pgdir = 0; //different with wait
@@ -539,6 +689,7 @@ scheduler(void){
   for(;;){
     sti();
     acquire(&ptable.lock);
+    rcuquiesce();
 
 
     for(int q=0; q<3; q++){
@@ -546,12 +697,18 @@ scheduler(void){
       for(p=ptable.proc; p<&ptable.proc[NPROC]; p++){
         if(p->state != RUNNABLE || p->priority != q) continue;
 
+        if(c->timeroff){
+          lapictimer(1);
+          c->timeroff = 0;
+        }
         c->proc = p;
         switchuvm(p);
         p->state = RUNNING;
         swtch(&(c->scheduler), p->context);
-        switchkvm();
+        // Leave p's page table loaded: if p or another thread
+        // of it runs next, switchuvm() need not flush the TLB.
         c->proc = 0;
+        rcuquiesce();
         found_proc_in_this_queue = 1;
       }
       if(found_proc_in_this_queue){
@@ -559,6 +716,30 @@ scheduler(void){
       }
     }
     release(&ptable.lock);
+
+    // Nothing is runnable: get pages zeroed ahead of time.
+    // Only the first CPU keeps time, so the others can do
+    // without timer interrupts until there is work again.
+    // Interrupts are on here, so use c, not cpuid().
+    kzerofill();
+    if(c != &cpus[0] && !c->timeroff){
+      lapictimer(0);
+      c->timeroff = 1;
+    }
+
+    // Halt until an interrupt, or until kickidle() sends
+    // one.  With interrupts off, none can slip in between the
+    // last look for work and the hlt; sti takes effect only
+    // after the hlt has begun.
+    cli();
+    c->idle = 1;
+    __sync_synchronize();
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+      if(p->state == RUNNABLE)
+        break;
+    if(p == &ptable.proc[NPROC])
+      asm volatile("sti; hlt");
+    c->idle = 0;
   }
 
 }
@@ -609,8 +790,18 @@ setnice(struct proc *p,int value){
 void
 yield(void)
 {
+  struct proc *p;
+
   acquire(&ptable.lock);  //DOC: yieldlock
   myproc()->state = RUNNABLE;
+  // If something else is waiting to run, it need not wait
+  // for this CPU while another one is halted.
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p != myproc() && p->state == RUNNABLE){
+      kickidle();
+      break;
+    }
+  }
 
   sched();
   release(&ptable.lock);
@@ -643,6 +834,7 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct proc **pp;
   if(p == 0)
     panic("sleep");
   if(lk == 0)
@@ -661,6 +853,10 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  for(pp = sleepq(chan); *pp; pp = &(*pp)->qnext)
+    ;
+  p->qnext = 0;
+  *pp = p;
   p->time_slice = 4;
 
   sched();
@@ -676,16 +872,55 @@ sleep(void *chan, struct spinlock *lk)
 }
 
 //PAGEBREAK!
-// Wake up all processes sleeping on chan.
+// A process was just made RUNNABLE: wake a halted CPU, if
+// there is one, to run it.  Caller holds ptable.lock.
+// Call once per process made RUNNABLE.
+static void
+kickidle(void)
+{
+  struct cpu *c, *me;
+
+  // Make the new state visible before looking at idle; the
+  // scheduler sets idle before its last look at the states.
+  __sync_synchronize();
+  // An interrupt taken out of hlt leaves this CPU's idle set,
+  // but it will look at the states before it halts again.
+  me = mycpu();
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c != me && c->idle && xchg(&c->idle, 0)){
+      lapicipi(c->apicid, T_WAKEUP);
+      return;
+    }
+  }
+}
+
+// The wait queue for chan.
+static struct proc**
+sleepq(void *chan)
+{
+  return &ptable.sleepq[((uint)chan * 2654435761u) >> (32 - SLEEPQBITS)];
+}
+
+// Wake up the processes sleeping on chan, or only the one
+// that has slept longest if one is set.
 // The ptable lock must be held.
 static void
-wakeup1(void *chan)
+wakeup1(void *chan, int one)
 {
-  struct proc *p;
+  struct proc *p, **pp;
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  pp = sleepq(chan);
+  while((p = *pp) != 0){
+    if(p->chan != chan){
+      pp = &p->qnext;
+      continue;
+    }
+    *pp = p->qnext;
+    p->state = RUNNABLE;
+    kickidle();
+    if(one)
+      break;
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -693,7 +928,17 @@ void
 wakeup(void *chan)
 {
   acquire(&ptable.lock);
-  wakeup1(chan);
+  wakeup1(chan, 0);
+  release(&ptable.lock);
+}
+
+// Wake up the process that has slept longest on chan, for
+// a lock that only one waiter can take.
+void
+wakeupone(void *chan)
+{
+  acquire(&ptable.lock);
+  wakeup1(chan, 1);
   release(&ptable.lock);
 }
 
@@ -703,15 +948,20 @@ wakeup(void *chan)
 int
 kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, **pp;
 
   acquire(&ptable.lock);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
+      if(p->state == SLEEPING){
+        for(pp = sleepq(p->chan); *pp != p; pp = &(*pp)->qnext)
+          ;
+        *pp = p->qnext;
         p->state = RUNNABLE;
+        kickidle();
+      }
       release(&ptable.lock);
       return 0;
     }
@@ -760,19 +1010,28 @@ procdump(void)
 void
 procdump_ps(void){
   struct proc *p;
+  enum procstate state;
+  char name[sizeof(p->name)];
+  int pid, priority;
+  uint nticks;
   extern uint ticks;
 
   cprintf("name\tpid\tstate\tprior\tticks: %d\n",ticks);
 
-  acquire(&ptable.lock);
-
+  // Read the table without ptable.lock, so that the scheduler
+  // need not wait while this prints to the console.  Slots
+  // are never freed, only reused; a process that changes
+  // meanwhile may show up half old, half new.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->state == SLEEPING || p->state == RUNNABLE || p->state == RUNNING || p->state == ZOMBIE){
-      cprintf("%s\t%d\t%d\t%d\t%d\n", p->name, p->pid, p->state, p->priority, p->ticks);
+    state = p->state;
+    if(state == SLEEPING || state == RUNNABLE || state == RUNNING || state == ZOMBIE){
+      safestrcpy(name, p->name, sizeof(name));
+      pid = p->pid;
+      priority = p->priority;
+      nticks = p->ticks;
+      cprintf("%s\t%d\t%d\t%d\t%d\n", name, pid, state, priority, nticks);
     }
   }
-
-  release(&ptable.lock);
 }
 
 
@@ -830,9 +1089,9 @@ mmap(int fd, int offset, int length, int flags, struct file *f)
   uint curr_addr = start_addr;
 
   while(bytes_left > 0){
-    char *mem = kalloc();
-    if(mem == 0) goto bad;
-    memset(mem,0,PGSIZE);
+    char *mem;
+    while((mem = kzalloc()) == 0)
+      if(kreclaim(0) < 0) goto bad;
 
     int n = (bytes_left < PGSIZE) ? bytes_left : PGSIZE;
 
@@ -894,10 +1153,24 @@ munmap(uint addr, int length)
   uint curr_addr = addr;
   int bytes_left = length;
 
+  // Unmap everything first and flush the TLBs once, so that
+  // no thread can still write a page while it is saved or
+  // after it is freed.  The address stays in the PTE.
+  while(bytes_left > 0){
+    pte_t *pte = walkpgdir(p->pgdir, (void*)curr_addr,0);
+    if(pte)
+      *pte &= ~PTE_P;
+    curr_addr += PGSIZE;
+    bytes_left -= PGSIZE;
+  }
+  tlbflush(p->pgdir, addr, PGROUNDUP(length) / PGSIZE);
+
+  curr_addr = addr;
+  bytes_left = length;
   while(bytes_left > 0){
     pte_t *pte = walkpgdir(p->pgdir, (void*)curr_addr,0);
 
-    if(pte && (*pte & PTE_P)){
+    if(pte && PTE_ADDR(*pte)){
       uint pa = PTE_ADDR(*pte);
 
       if(*pte & PTE_D){
@@ -953,7 +1226,9 @@ mutex_unlock(void *l)
   acquire(&ptable.lock);
 
   *(int*)l = 0;
-  wakeup1(l);
+  // l is a user address, which other processes may use for
+  // locks of their own: wake every sleeper, not just one.
+  wakeup1(l, 0);
 
   release(&ptable.lock);
 
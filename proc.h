@@ -8,6 +8,11 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  pde_t *volatile curpgdir;    // User page table in %cr3, or 0
+  volatile int tlbpending;     // tlbreq asks this cpu to flush
+  int timeroff;                // lapic timer stopped while idle
+  volatile uint idle;          // halted, or about to, in scheduler()
+  volatile uint rcuepoch;      // rcu.epoch when last in scheduler()
 };
 
 extern struct cpu cpus[NCPU];
@@ -55,9 +60,14 @@ struct proc {
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *qnext;          // Next sleeper in chan's wait queue
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
+  struct file **ofile;         // Open files, nofile slots
+  int nofile;                  // Size of ofile
+  int fdfree;                  // No free slot in ofile below this
+  struct file *ofile0[NOFILE]; // Initial ofile, before it grows
   struct inode *cwd;           // Current directory
+  struct image *img;           // Executable, paged in on demand
   char name[16];               // Process name (debugging)
   int nice;
   uint ticks;
@@ -65,6 +75,8 @@ struct proc {
   int time_slice;
 
   struct mmap_page mmaps[MAX_MMAP_PROC];
+  int swapwant;                // Pages kswapd asks this process to evict
+  uint swaphand;               // Where swapself() resumes its scan
 
   //PA4
   int tid;
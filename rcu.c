@@ -0,0 +1,120 @@
+// Read-copy-update, for data that is read far more often
+// than it changes.
+//
+// A reader brackets its use of the data with rcubegin() and
+// rcuend(), which take no lock and write nothing shared: they
+// only keep the reader's CPU from switching processes.  A
+// writer, holding whatever lock orders writers, unlinks an
+// object so that no new reader can find it, then passes it to
+// rcudefer(), which frees it once every reader that might
+// still see it is done.
+//
+// Each CPU notes rcu.epoch in its cpu struct every time
+// through scheduler(), where it cannot be inside a reader.
+// Once all CPUs have noted the current epoch, or are idle, the
+// epoch advances.  An object deferred during epoch e is freed
+// when the epoch reaches e+2: the readers that could see it
+// started before it was unlinked, so in epoch e or earlier, and
+// have finished by the time every CPU has passed through the
+// scheduler in epoch e+1.  The first CPU advances the epoch
+// and frees objects from its clock interrupt.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+struct rcudefer {
+  void (*fn)(void*);
+  void *arg;
+  uint epoch;     // rcu.epoch when deferred
+};
+
+struct {
+  struct spinlock lock;
+  volatile uint epoch;
+  struct rcudefer defer[NRCU];  // a ring, oldest at head
+  uint head;
+  uint n;
+} rcu;
+
+void
+rcuinit(void)
+{
+  initlock(&rcu.lock, "rcu");
+}
+
+void
+rcubegin(void)
+{
+  pushcli();
+}
+
+void
+rcuend(void)
+{
+  popcli();
+}
+
+// Call fn(arg) once no reader can be using arg.  Sleeps if
+// too many calls are waiting already.
+void
+rcudefer(void (*fn)(void*), void *arg)
+{
+  struct rcudefer *d;
+
+  acquire(&rcu.lock);
+  while(rcu.n == NRCU)
+    sleep(&rcu.n, &rcu.lock);
+  d = &rcu.defer[(rcu.head + rcu.n) % NRCU];
+  d->fn = fn;
+  d->arg = arg;
+  d->epoch = rcu.epoch;
+  rcu.n++;
+  release(&rcu.lock);
+}
+
+// This CPU is not inside a reader.  Called from scheduler().
+void
+rcuquiesce(void)
+{
+  __sync_synchronize();
+  mycpu()->rcuepoch = rcu.epoch;
+}
+
+// Advance the epoch if every CPU has seen it, and run the
+// deferred calls that are due.  Called on clock interrupts.
+void
+rcupoll(void)
+{
+  struct rcudefer d;
+  struct cpu *c;
+  int ran;
+
+  if(rcu.n == 0)
+    return;
+  acquire(&rcu.lock);
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(c->rcuepoch != rcu.epoch && !c->idle)
+      break;
+  if(c == &cpus[ncpu])
+    rcu.epoch++;
+
+  ran = 0;
+  while(rcu.n > 0 && rcu.epoch - rcu.defer[rcu.head].epoch >= 2){
+    d = rcu.defer[rcu.head];
+    rcu.head = (rcu.head + 1) % NRCU;
+    rcu.n--;
+    release(&rcu.lock);
+    d.fn(d.arg);
+    acquire(&rcu.lock);
+    ran = 1;
+  }
+  if(ran)
+    wakeup(&rcu.n);
+  release(&rcu.lock);
+}
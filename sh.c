@@ -52,6 +52,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int gettoken(char**, char*, char**, char**);
 
 // Execute cmd.  Never returns.
 void
@@ -130,6 +131,135 @@ runcmd(struct cmd *cmd)
   exit();
 }
 
+// Start cmd, made of simple commands, redirections and
+// pipes only, with spawn() instead of fork() and exec().
+// Command descriptor i is the shell's fds[i].  Returns the
+// number of children started, for the caller to wait for.
+int
+spawncmd(struct cmd *cmd, int *fds)
+{
+  int p[2], n, fd, cfds[3];
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  memmove(cfds, fds, sizeof(cfds));
+  switch(cmd->type){
+  default:
+    panic("spawncmd");
+
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(ecmd->argv[0] == 0)
+      return 0;
+    if(spawn(ecmd->argv[0], ecmd->argv, cfds) < 0){
+      printf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      printf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    cfds[rcmd->fd] = fd;
+    n = spawncmd(rcmd->cmd, cfds);
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    // This runs in the shell itself, so fail the command
+    // rather than the shell; what is already running on
+    // the left is still counted by the caller.
+    if(pipe(p) < 0){
+      printf(2, "pipe failed\n");
+      return 0;
+    }
+    cfds[1] = p[1];
+    n = spawncmd(pcmd->left, cfds);
+    cfds[1] = fds[1];
+    cfds[0] = p[0];
+    n += spawncmd(pcmd->right, cfds);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  return 0;
+}
+
+// Free a command built by parsecmd().
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
+
+// Report whether buf holds only words, redirections and
+// pipes in a form that parses without error, so that the
+// shell itself can parse it and spawn the commands: a
+// syntax error makes the parser exit.
+int
+simpleline(char *buf)
+{
+  char *s, *es;
+  int argc;
+
+  s = buf;
+  es = s + strlen(s);
+  argc = 0;
+  for(;;){
+    switch(gettoken(&s, es, 0, 0)){
+    case 0:
+      return 1;
+    case 'a':
+      if(++argc >= MAXARGS)
+        return 0;
+      break;
+    case '|':
+      argc = 0;
+      break;
+    case '<':
+    case '>':
+    case '+':
+      if(gettoken(&s, es, 0, 0) != 'a')
+        return 0;
+      break;
+    default:
+      return 0;
+    }
+  }
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -145,7 +275,9 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  static int stdfds[3] = { 0, 1, 2 };
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -164,6 +296,14 @@ main(void)
         printf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    if(simpleline(buf)){
+      // No need to fork a copy of the shell for these.
+      cmd = parsecmd(buf);
+      for(n = spawncmd(cmd, stdfds); n > 0; n--)
+        wait();
+      freecmd(cmd);
+      continue;
+    }
     if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait();
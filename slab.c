@@ -0,0 +1,150 @@
+// Slab allocator for small kernel objects.
+//
+// A slab is one page: a struct slab header followed by as
+// many objects as fit.  Free objects are linked through
+// their first word.  Pages with a free object are on the
+// cache's partial list; a page whose objects are all free is
+// given back to kalloc() unless it is the only one left.
+//
+// In front of the slabs every CPU has a magazine of KMMAG
+// free objects.  kmalloc() and kmfree() use it with
+// interrupts off and take the cache lock only to move half
+// a magazine at a time to or from the slabs.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "slab.h"
+
+struct slab {
+  struct kmcache *cache;
+  struct slab *prev;     // on cache->partial
+  struct slab *next;
+  void *free;            // free objects in this page
+  int nfree;
+};
+
+void
+kminit(struct kmcache *c, char *name, uint size)
+{
+  c->name = name;
+  c->size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  c->perslab = (PGSIZE - sizeof(struct slab)) / c->size;
+  if(c->perslab < 1)
+    panic("kminit");
+  initlock(&c->lock, name);
+}
+
+static void
+slabunlink(struct kmcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+static void
+slablink(struct kmcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Take an object from c's slabs, adding a page if none has
+// a free one.  Caller holds c->lock.
+static void*
+slaballoc(struct kmcache *c)
+{
+  struct slab *s;
+  char *o;
+  int i;
+
+  if((s = c->partial) == 0){
+    if((s = (struct slab*)kalloc()) == 0)
+      return 0;
+    s->cache = c;
+    s->free = 0;
+    for(i = c->perslab - 1; i >= 0; i--){
+      o = (char*)(s + 1) + i*c->size;
+      *(void**)o = s->free;
+      s->free = o;
+    }
+    s->nfree = c->perslab;
+    slablink(c, s);
+    c->nslab++;
+  }
+  o = s->free;
+  s->free = *(void**)o;
+  if(--s->nfree == 0)
+    slabunlink(c, s);
+  return o;
+}
+
+// Put object o back in its slab.  Caller holds c->lock.
+static void
+slabfree(struct kmcache *c, void *o)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)o);
+  if(s->cache != c)
+    panic("kmfree");
+  *(void**)o = s->free;
+  s->free = o;
+  if(s->nfree++ == 0)
+    slablink(c, s);
+  if(s->nfree == c->perslab && (s->prev || s->next)){
+    slabunlink(c, s);
+    c->nslab--;
+    kfree((char*)s);
+  }
+}
+
+// Allocate an object from cache c.  Its contents are
+// whatever the last user left.  Returns 0 if out of memory.
+void*
+kmalloc(struct kmcache *c)
+{
+  void *o;
+  int i;
+
+  pushcli();
+  i = cpuid();
+  if(c->mag[i].n == 0){
+    acquire(&c->lock);
+    while(c->mag[i].n < KMMAG/2 && (o = slaballoc(c)) != 0)
+      c->mag[i].obj[c->mag[i].n++] = o;
+    release(&c->lock);
+  }
+  o = 0;
+  if(c->mag[i].n > 0)
+    o = c->mag[i].obj[--c->mag[i].n];
+  popcli();
+  return o;
+}
+
+// Free object o, which came from kmalloc(c).
+void
+kmfree(struct kmcache *c, void *o)
+{
+  int i;
+
+  pushcli();
+  i = cpuid();
+  if(c->mag[i].n == KMMAG){
+    acquire(&c->lock);
+    while(c->mag[i].n > KMMAG/2)
+      slabfree(c, c->mag[i].obj[--c->mag[i].n]);
+    release(&c->lock);
+  }
+  c->mag[i].obj[c->mag[i].n++] = o;
+  popcli();
+}
@@ -0,0 +1,20 @@
+// A cache of kernel objects of one size, carved out of
+// pages from kalloc().  Each CPU keeps a few free objects
+// of its own so that most allocations take no lock.
+// See slab.c.
+
+#define KMMAG 8  // free objects each CPU holds on to
+
+struct kmcache {
+  char *name;
+  uint size;             // object size, rounded up to a word
+  int perslab;           // objects per page
+  struct spinlock lock;  // protects partial and nslab
+  struct slab *partial;  // pages with free objects
+  int nslab;             // pages in use
+  struct {
+    int n;
+    void *obj[KMMAG];
+  } mag[NCPU];           // per-CPU free objects; touched with
+                         // interrupts off, by that CPU only
+};
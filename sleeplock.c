@@ -37,7 +37,7 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  wakeupone(lk);
   release(&lk->lk);
 }
 
@@ -52,5 +52,99 @@ holdingsleep(struct sleeplock *lk)
   return r;
 }
 
+void
+initrwsleeplock(struct rwsleeplock *lk, char *name)
+{
+  initlock(&lk->lk, "rw sleep lock");
+  lk->name = name;
+  lk->state = 0;
+  lk->wwait = 0;
+  lk->pid = 0;
+}
+
+// The common case, with no writer around, is a single
+// cmpxchg.  Otherwise sleep under lk->lk, which every
+// change to RWWRITER and RWWAIT holds.
+void
+acquireread(struct rwsleeplock *lk)
+{
+  uint s;
+
+  s = lk->state;
+  if((s & (RWWRITER|RWWAIT)) == 0 && cmpxchg(&lk->state, s, s+1) == s)
+    return;
+  acquire(&lk->lk);
+  for(;;){
+    s = lk->state;
+    if(s & (RWWRITER|RWWAIT))
+      sleep(lk, &lk->lk);
+    else if(cmpxchg(&lk->state, s, s+1) == s)
+      break;
+  }
+  release(&lk->lk);
+}
+
+// Only the last reader out with a writer waiting takes
+// lk->lk, to wake it.
+void
+releaseread(struct rwsleeplock *lk)
+{
+  uint s;
 
+  for(;;){
+    s = lk->state;
+    if((s & ~(RWWRITER|RWWAIT)) == 0)
+      panic("releaseread");
+    if(s & RWWAIT)
+      break;
+    if(cmpxchg(&lk->state, s, s-1) == s)
+      return;
+  }
+  acquire(&lk->lk);
+  if(xadd(&lk->state, -1) - 1 == RWWAIT)
+    wakeupone(&lk->wwait);
+  release(&lk->lk);
+}
 
+void
+acquirewrite(struct rwsleeplock *lk)
+{
+  uint s;
+
+  acquire(&lk->lk);
+  lk->wwait++;
+  do
+    s = lk->state;
+  while(cmpxchg(&lk->state, s, s|RWWAIT) != s);
+  while(lk->state & ~RWWAIT)
+    sleep(&lk->wwait, &lk->lk);
+  // No reader can get in while RWWAIT is set.
+  lk->wwait--;
+  xchg(&lk->state, RWWRITER | (lk->wwait ? RWWAIT : 0));
+  lk->pid = myproc()->pid;
+  release(&lk->lk);
+}
+
+// Writers waiting go first; otherwise let in all the
+// readers that queued up behind this writer.
+void
+releasewrite(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->pid = 0;
+  if(lk->wwait){
+    xchg(&lk->state, RWWAIT);
+    wakeupone(&lk->wwait);
+  } else {
+    xchg(&lk->state, 0);
+    wakeup(lk);
+  }
+  release(&lk->lk);
+}
+
+// Only the holder sets pid to its own, so this needs no lock.
+int
+holdingwrite(struct rwsleeplock *lk)
+{
+  return (lk->state & RWWRITER) && lk->pid == myproc()->pid;
+}
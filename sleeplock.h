@@ -8,3 +8,18 @@ struct sleeplock {
   int pid;           // Process holding lock
 };
 
+// Long-term reader-writer locks: any number of readers, or
+// one writer.  Once a writer waits, new readers wait too.
+// Readers that need not wait only cmpxchg state; lk is taken
+// to sleep on the lock or to wake its sleepers.
+struct rwsleeplock {
+  volatile uint state; // RWWRITER, RWWAIT, plus the number of readers
+  struct spinlock lk;  // protects wwait; held to sleep or wake
+  int wwait;           // writers waiting
+
+  // For debugging:
+  char *name;         // Name of lock.
+  int pid;            // Process holding it exclusive
+};
+
+#define RWWAIT 0x40000000  // in rwsleeplock state: writers waiting
@@ -1,4 +1,13 @@
 // Mutual exclusion spin locks.
+//
+// A lock is a ticket lock: each acquirer takes the next ticket
+// and waits until the holder hands the lock on to it, so
+// waiters get the lock in the order they asked for it, and
+// spin reading the lock without writing to it.
+//
+// Each CPU counts the acquisitions of each lock name, how many
+// had to wait and for how long, so acquire() only writes lines
+// of its own; klockstat() adds the CPUs up.
 
 #include "types.h"
 #include "defs.h"
@@ -8,12 +17,87 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "lockstat.h"
+
+#define NLOCKSLOT 128  // name pointers each CPU remembers
+
+// Lock names in the order they were first acquired.  Entries
+// are never removed, so an index stands for the same name for
+// good.
+static struct {
+  uint lock;
+  int n;
+  char name[NLOCKSTAT][16];
+} locks;
+
+// Each CPU's counters, indexed like locks.name, and a hash
+// table from the name pointers it has seen to their indexes.
+struct cpulocks {
+  struct {
+    char *name;
+    int i;       // index into locks.name, or -1 if it is full
+  } slot[NLOCKSLOT];
+  struct {
+    uint nacquire;
+    uint ncontend;
+    uint64 spin;
+  } stat[NLOCKSTAT];
+};
+
+static struct cpulocks cpulocks[NCPU];
+
+// The index of the lock name name, adding it if it is new.
+// Returns -1 if there are too many names.
+static int
+lockname(char *name)
+{
+  int i;
+
+  while(xchg(&locks.lock, 1) != 0)
+    pause();
+  for(i = 0; i < locks.n; i++)
+    if(strncmp(locks.name[i], name, sizeof(locks.name[i])-1) == 0)
+      break;
+  if(i == NLOCKSTAT)
+    i = -1;
+  else if(i == locks.n){
+    safestrcpy(locks.name[i], name, sizeof(locks.name[i]));
+    locks.n++;
+  }
+  xchg(&locks.lock, 0);
+  return i;
+}
+
+// The index of name in locks, or -1 if it is not counted.
+// Usually found in cl, this CPU's table; only the first use
+// of a name pointer on a CPU looks at locks.
+static int
+lockindex(struct cpulocks *cl, char *name)
+{
+  uint h;
+  int n;
+
+  h = ((uint)name * 2654435761u) % NLOCKSLOT;
+  for(n = 0; n < NLOCKSLOT; n++){
+    if(cl->slot[h].name == name)
+      return cl->slot[h].i;
+    if(cl->slot[h].name == 0)
+      break;
+    h = (h + 1) % NLOCKSLOT;
+  }
+  if(n == NLOCKSLOT)
+    return -1;
+  cl->slot[h].name = name;
+  cl->slot[h].i = lockname(name);
+  return cl->slot[h].i;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
 }
 
@@ -24,13 +108,28 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  struct cpulocks *cl;
+  uint64 spin;
+  uint ticket;
+  int i, waited;
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  // The xadd is atomic.
+  ticket = xadd(&lk->next, 1);
+  waited = 0;
+  if(lk->owner != ticket){
+    waited = 1;
+    spin = rdtsc();
+    // The holder may be waiting for this CPU to flush its TLB.
+    while(lk->owner != ticket){
+      tlbintr();
+      pause();
+    }
+    spin = rdtsc() - spin;
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +139,15 @@ acquire(struct spinlock *lk)
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
   getcallerpcs(&lk, lk->pcs);
+
+  cl = &cpulocks[lk->cpu - cpus];
+  if((i = lockindex(cl, lk->name)) >= 0){
+    cl->stat[i].nacquire++;
+    if(waited){
+      cl->stat[i].ncontend++;
+      cl->stat[i].spin += spin;
+    }
+  }
 }
 
 // Release the lock.
@@ -59,11 +167,79 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  // Hand the lock to the next ticket.  Only the holder writes
+  // lk->owner, so a plain store will do; it is written in asm
+  // so that it is a single 32-bit store.
+  asm volatile("movl %1, %0" : "=m" (lk->owner) : "r" (lk->owner + 1));
+
+  popcli();
+}
+
+void
+initrwlock(struct rwlock *rw, char *name)
+{
+  rw->name = name;
+  rw->state = 0;
+}
+
+// Acquire rw shared.  Each reader adds itself to rw->state
+// with a cmpxchg, and waits only while a writer holds rw or
+// is waiting for it.
+void
+rlock(struct rwlock *rw)
+{
+  uint s;
+
+  pushcli();
+  for(;;){
+    s = rw->state;
+    if((s & RWWRITER) == 0 && cmpxchg(&rw->state, s, s+1) == s)
+      break;
+    // The writer may be waiting for this CPU to flush its TLB.
+    tlbintr();
+    pause();
+  }
+}
+
+void
+runlock(struct rwlock *rw)
+{
+  if((rw->state & ~RWWRITER) == 0)
+    panic("runlock");
+  xadd(&rw->state, -1);
+  popcli();
+}
+
+// Acquire rw exclusive.  Setting RWWRITER first keeps new
+// readers out while the ones inside drain, so a stream of
+// readers cannot starve the writer.
+void
+wlock(struct rwlock *rw)
+{
+  uint s;
+
+  pushcli();
+  for(;;){
+    s = rw->state;
+    if((s & RWWRITER) == 0 && cmpxchg(&rw->state, s, s|RWWRITER) == s)
+      break;
+    tlbintr();
+    pause();
+  }
+  while(rw->state != RWWRITER){
+    tlbintr();
+    pause();
+  }
+  __sync_synchronize();
+}
 
+void
+wunlock(struct rwlock *rw)
+{
+  if(rw->state != RWWRITER)
+    panic("wunlock");
+  __sync_synchronize();
+  asm volatile("movl $0, %0" : "+m" (rw->state) : );
   popcli();
 }
 
@@ -91,11 +267,34 @@ holding(struct spinlock *lock)
 {
   int r;
   pushcli();
-  r = lock->locked && lock->cpu == mycpu();
+  r = lock->owner != lock->next && lock->cpu == mycpu();
   popcli();
   return r;
 }
 
+// Copy out up to n entries of lock statistics, adding up the
+// CPUs; returns how many there are.  Another CPU's counters
+// may be a moment out of date.
+int
+klockstat(struct lockstat *st, int n)
+{
+  struct cpulocks *cl;
+  int i;
+
+  if(n > locks.n)
+    n = locks.n;
+  for(i = 0; i < n; i++){
+    safestrcpy(st[i].name, locks.name[i], sizeof(st[i].name));
+    st[i].nacquire = st[i].ncontend = 0;
+    st[i].spin = 0;
+    for(cl = cpulocks; cl < &cpulocks[ncpu]; cl++){
+      st[i].nacquire += cl->stat[i].nacquire;
+      st[i].ncontend += cl->stat[i].ncontend;
+      st[i].spin += cl->stat[i].spin;
+    }
+  }
+  return n;
+}
 
 // Pushcli/popcli are like cli/sti except that they are matched:
 // it takes two popcli to undo two pushcli.  Also, if interrupts
@@ -1,6 +1,7 @@
 // Mutual exclusion lock.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;           // Next ticket to hand out
+  volatile uint owner; // Ticket now holding the lock
 
   // For debugging:
   char *name;        // Name of lock.
@@ -9,3 +10,11 @@ struct spinlock {
                      // that locked the lock.
 };
 
+// Reader-writer spin lock: any number of readers, or one
+// writer.
+struct rwlock {
+  volatile uint state; // RWWRITER, plus the number of readers
+  char *name;          // Name of lock.
+};
+
+#define RWWRITER 0x80000000
@@ -1,14 +1,31 @@
 #include "types.h"
 #include "x86.h"
 
+// The bulk of each copy, fill and comparison goes a 32-bit
+// word at a time, with the destination aligned first so
+// rep movsl and rep stosl run at full speed.
+
+// Whether any byte of w is zero.
+#define HASZERO(w) (((w) - 0x01010101) & ~(w) & 0x80808080)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  if ((int)dst%4 == 0 && n%4 == 0){
-    c &= 0xFF;
-    stosl(dst, (c<<24)|(c<<16)|(c<<8)|c, n/4);
-  } else
-    stosb(dst, c, n);
+  char *d;
+  uint k;
+
+  d = dst;
+  c &= 0xFF;
+  if(n >= 16){
+    k = -(uint)d & 3;
+    stosb(d, c, k);
+    d += k;
+    n -= k;
+    stosl(d, (c<<24)|(c<<16)|(c<<8)|c, n/4);
+    d += n & ~3;
+    n &= 3;
+  }
+  stosb(d, c, n);
   return dst;
 }
 
@@ -19,6 +36,11 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  while(n >= 4 && *(uint*)s1 == *(uint*)s2){
+    s1 += 4;
+    s2 += 4;
+    n -= 4;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -33,17 +55,43 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  uint k;
+  uint *dw;
+  const uint *sw;
 
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // Copy down from the end, so as not to overwrite
+    // bytes of src before they are copied.
     s += n;
     d += n;
+    // A word loop, not std; rep movsl: the copy can be
+    // interrupted, and nothing else expects the direction
+    // flag set.
+    if(n >= 16)
+      for(k = (uint)d & 3; k > 0; k--, n--)
+        *--d = *--s;
+    dw = (uint*)d;
+    sw = (const uint*)s;
+    for(k = n/4; k > 0; k--)
+      *--dw = *--sw;
+    d = (char*)dw;
+    s = (const char*)sw;
+    n &= 3;
     while(n-- > 0)
       *--d = *--s;
-  } else
-    while(n-- > 0)
-      *d++ = *s++;
+  } else {
+    if(n >= 16){
+      k = -(uint)d & 3;
+      movsb(d, s, k);
+      d += k;
+      s += k;
+      n -= k;
+    }
+    movsl(d, s, n/4);
+    movsb(d + (n & ~3), s + (n & ~3), n & 3);
+  }
 
   return dst;
 }
@@ -96,10 +144,17 @@ safestrcpy(char *s, const char *t, int n)
 int
 strlen(const char *s)
 {
-  int n;
-
-  for(n = 0; s[n]; n++)
-    ;
-  return n;
+  const char *p;
+
+  // An aligned word never crosses into the next page, so
+  // reading past the end of s is safe.
+  for(p = s; (uint)p & 3; p++)
+    if(*p == 0)
+      return p - s;
+  while(!HASZERO(*(uint*)p))
+    p += 4;
+  while(*p)
+    p++;
+  return p - s;
 }
 
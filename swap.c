@@ -0,0 +1,248 @@
+// Reclaiming memory when it runs low.
+//
+// kswapd, a kernel process, wakes on every clock tick and
+// acts once free pages drop below KSWAPLOW, until there are
+// KSWAPHIGH again.  It first drops extra disk buffers, cached
+// executables and image pages no process maps, which can be
+// read in again.
+// Then it asks processes to evict some of their own pages:
+// each does so the next time it returns to user space, when
+// no system call of its can be in the middle of copying to
+// or from them.  Read-only and clean mmap pages are simply
+// unmapped; dirty private pages go to the swap area on the
+// boot disk and pagefault() reads them back.
+//
+// An allocation in the page fault path that finds no free
+// page calls kreclaim() and waits for kswapd, instead of
+// killing the process.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "fs.h"
+
+struct {
+  struct spinlock lock;
+  uchar used[NSWAPPG];  // swap slots in use
+  int next;             // where to look for a free slot
+  uint pass;            // kswapd passes completed
+} swap;
+
+static void kswapd(void);
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  kthread("kswapd", kswapd);
+}
+
+// Allocate a swap slot.  Returns -1 if swap is full.
+static int
+swapalloc(void)
+{
+  int i, slot;
+
+  acquire(&swap.lock);
+  for(i = 0; i < NSWAPPG; i++){
+    slot = (swap.next + i) % NSWAPPG;
+    if(!swap.used[slot]){
+      swap.used[slot] = 1;
+      swap.next = slot + 1;
+      release(&swap.lock);
+      return slot;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+void
+swapfree(int slot)
+{
+  acquire(&swap.lock);
+  if(slot < 0 || slot >= NSWAPPG || !swap.used[slot])
+    panic("swapfree");
+  swap.used[slot] = 0;
+  release(&swap.lock);
+}
+
+// Read the page in swap slot into mem.  The slot stays
+// allocated; the caller frees it once the page is mapped.
+void
+swapload(char *mem, int slot)
+{
+  swapread(mem, slot * (PGSIZE/BSIZE));
+}
+
+// Pages unmapped from the current process, waiting for one
+// TLB flush before they are freed.
+struct evictbatch {
+  char *page[SWAPBATCH];
+  int n;
+  uint lo, hi;   // lowest and highest address unmapped
+};
+
+static void
+evictflush(struct evictbatch *b)
+{
+  int i;
+
+  if(b->n == 0)
+    return;
+  tlbflush(myproc()->pgdir, b->lo, (b->hi - b->lo) / PGSIZE + 1);
+  for(i = 0; i < b->n; i++)
+    kfree(b->page[i]);
+  b->n = 0;
+}
+
+// Page v was mapped at va until the caller cleared its PTE.
+static void
+evict(struct evictbatch *b, char *v, uint va)
+{
+  if(b->n == 0 || va < b->lo)
+    b->lo = va;
+  if(b->n == 0 || va > b->hi)
+    b->hi = va;
+  b->page[b->n++] = v;
+  if(b->n == SWAPBATCH)
+    evictflush(b);
+}
+
+// Evict up to n pages of the current process.  Only safe
+// where none of its system calls can be using its memory,
+// and only if no other thread shares its page table.
+// Pages touched since the last scan get another chance.
+// Returns the number of pages freed.
+int
+swapself(int n)
+{
+  struct proc *p = myproc();
+  struct mmap_page *m;
+  struct evictbatch b;
+  pte_t *pte;
+  char *v;
+  uint va, scanned;
+  int freed, slot;
+
+  p->swapwant = 0;
+  if(n <= 0 || pgdirref(p->pgdir) > 1)
+    return 0;
+  freed = 0;
+  b.n = 0;
+
+  // Clean mmap pages: the file has the same bytes.
+  for(m = p->mmaps; m < &p->mmaps[MAX_MMAP_PROC] && freed < n; m++){
+    if(!m->used)
+      continue;
+    for(va = m->addr; va < m->addr + m->length && freed < n; va += PGSIZE){
+      pte = walkpgdir(p->pgdir, (char*)va, 0);
+      if(pte == 0 || (*pte & (PTE_P|PTE_D)) != PTE_P)
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        invlpg((void*)va);
+        continue;
+      }
+      v = P2V(PTE_ADDR(*pte));
+      *pte = 0;
+      evict(&b, v, va);
+      freed++;
+    }
+  }
+
+  // Then the program, heap and stack, clock-wise.
+  va = p->swaphand;
+  for(scanned = 0; scanned < p->sz && freed < n; va += PGSIZE, scanned += PGSIZE){
+    if(va >= p->sz)
+      va = 0;
+    if((p->pgdir[PDX(va)] & (PTE_P|PTE_PS)) != PTE_P){
+      // No page table here, or a superpage: skip all 4MB.
+      scanned += PGADDR(PDX(va) + 1, 0, 0) - PGSIZE - va;
+      va = PGADDR(PDX(va) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    pte = walkpgdir(p->pgdir, (char*)va, 0);
+    if((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      invlpg((void*)va);
+      continue;
+    }
+    v = P2V(PTE_ADDR(*pte));
+    if(*pte & PTE_W){
+      // A private page: save it in swap.
+      if(krefcnt(v) != 1 || (slot = swapalloc()) < 0)
+        continue;
+      swapwrite(v, slot * (PGSIZE/BSIZE));
+      *pte = SWAPPTE(slot);
+    } else {
+      // Program text or data, or the zero page: faulted in
+      // again from the image, or as zeros.
+      if(krefcnt(v) == 1)
+        freed++;
+      *pte = 0;
+      evict(&b, v, va);
+      continue;
+    }
+    evict(&b, v, va);
+    freed++;
+  }
+  p->swaphand = va;
+  evictflush(&b);
+  return freed;
+}
+
+// An allocation for the current process failed.  Wait for
+// kswapd to make a pass; self says the process is at a point
+// where it may first evict pages of its own.  Returns 0 if
+// the caller should try again, -1 if memory is exhausted.
+int
+kreclaim(int self)
+{
+  uint pass;
+
+  if(self && swapself(SWAPBATCH) > 0)
+    return 0;
+  acquire(&swap.lock);
+  pass = swap.pass;
+  // A pass may be under way already; wait for a whole one.
+  while(swap.pass - pass < 2 && !myproc()->killed)
+    sleep(&swap.pass, &swap.lock);
+  release(&swap.lock);
+  if(myproc()->killed || kfreecount() == 0)
+    return -1;
+  return 0;
+}
+
+static void
+kswapd(void)
+{
+  int nfree;
+
+  for(;;){
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    nfree = kfreecount();
+    if(nfree < KSWAPLOW){
+      breclaim();
+      imgreclaim(KSWAPHIGH - nfree);
+      nfree = kfreecount();
+      if(nfree < KSWAPHIGH)
+        askreclaim(KSWAPHIGH - nfree);
+    }
+
+    acquire(&swap.lock);
+    swap.pass++;
+    wakeup(&swap.pass);
+    release(&swap.lock);
+  }
+}
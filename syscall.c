@@ -21,6 +21,8 @@ fetchint(uint addr, int *ip)
 
   if(addr >= curproc->sz || addr+4 > curproc->sz)
     return -1;
+  if(prefault(addr, 4, 0) < 0)
+    return -1;
   *ip = *(int*)(addr);
   return 0;
 }
@@ -39,6 +41,8 @@ fetchstr(uint addr, char **pp)
   *pp = (char*)addr;
   ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) && prefault((uint)s, 1, 0) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -54,7 +58,9 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process address space.  Pages are left to
+// fault in as they are used; code that copies while holding
+// a lock calls prefault() for the part it copies.
 int
 argptr(int n, char **pp, int size)
 {
@@ -115,6 +121,17 @@ extern int sys_mutex_lock(void);
 extern int sys_mutex_unlock(void);
 extern int sys_mmap(void);
 extern int sys_munmap(void);
+extern int sys_splice(void);
+extern int sys_pipesize(void);
+extern int sys_poll(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_pread(void);
+extern int sys_pwrite(void);
+extern int sys_spawn(void);
+extern int sys_memstat(void);
+extern int sys_clocktime(void);
+extern int sys_lockstat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -150,6 +167,17 @@ static int (*syscalls[])(void) = {
 [SYS_mutex_unlock] sys_mutex_unlock,
 [SYS_mmap]    sys_mmap,
 [SYS_munmap]  sys_munmap,
+[SYS_splice]  sys_splice,
+[SYS_pipesize] sys_pipesize,
+[SYS_poll]    sys_poll,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_spawn]   sys_spawn,
+[SYS_memstat] sys_memstat,
+[SYS_clocktime] sys_clocktime,
+[SYS_lockstat] sys_lockstat,
 };
 
 void
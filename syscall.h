@@ -31,4 +31,15 @@
 #define SYS_clone  30
 #define SYS_join   31
 #define SYS_mutex_lock 32
-#define SYS_mutex_unlock 33
\ No newline at end of file
+#define SYS_mutex_unlock 33
+#define SYS_splice 34
+#define SYS_pipesize 35
+#define SYS_poll   36
+#define SYS_readv  37
+#define SYS_writev 38
+#define SYS_pread  39
+#define SYS_pwrite 40
+#define SYS_spawn  41
+#define SYS_memstat 42
+#define SYS_clocktime 43
+#define SYS_lockstat 44
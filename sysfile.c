@@ -15,6 +15,8 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "poll.h"
+#include "uio.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -26,7 +28,7 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= myproc()->nofile || (f=myproc()->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -35,23 +37,6 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
-// Allocate a file descriptor for the given file.
-// Takes over file reference from caller on success.
-static int
-fdalloc(struct file *f)
-{
-  int fd;
-  struct proc *curproc = myproc();
-
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
-      return fd;
-    }
-  }
-  return -1;
-}
-
 int
 sys_dup(void)
 {
@@ -90,6 +75,104 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Fetch the iovec array at argument n with cnt entries into
+// kiov, checking that every buffer lies in user memory.
+// Copying the array keeps another thread from changing it
+// after the check.
+static int
+argiov(int n, int cnt, struct iovec *kiov)
+{
+  int i;
+  char *p;
+  uint sz = myproc()->sz;
+
+  if(cnt < 0 || cnt > IOV_MAX || argptr(n, &p, cnt*sizeof(*kiov)) < 0)
+    return -1;
+  memmove(kiov, p, cnt*sizeof(*kiov));
+  for(i = 0; i < cnt; i++){
+    if(kiov[i].iov_len > sz || (uint)kiov[i].iov_base >= sz ||
+       (uint)kiov[i].iov_base + kiov[i].iov_len > sz)
+      return -1;
+  }
+  return 0;
+}
+
+int
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, cnt, iov) < 0)
+    return -1;
+  return filereadv(f, iov, cnt);
+}
+
+int
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[IOV_MAX];
+  int cnt;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, cnt, iov) < 0)
+    return -1;
+  return filewritev(f, iov, cnt);
+}
+
+int
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 ||
+     argint(3, &off) < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+int
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 ||
+     argint(3, &off) < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+// Move up to n bytes from one descriptor to another
+// without copying them through user space.
+int
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+int
+sys_poll(void)
+{
+  struct pollfd *fds;
+  int nfds, timeout;
+
+  if(argint(1, &nfds) < 0 || argint(2, &timeout) < 0)
+    return -1;
+  if(nfds < 0 || argptr(0, (void*)&fds, nfds*sizeof(*fds)) < 0)
+    return -1;
+  return poll(fds, nfds, timeout);
+}
+
 int
 sys_close(void)
 {
@@ -106,7 +189,7 @@ sys_close(void)
     }
   }
   
-  p->ofile[fd] = 0;
+  fdremove(fd);
   fileclose(f);
   return 0;
 }
@@ -117,7 +200,8 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0 ||
+     prefault((uint)st, sizeof(*st), 1) < 0)
     return -1;
   return filestat(f, st);
 }
@@ -234,6 +318,8 @@ sys_unlink(void)
 
   ip->nlink--;
   iupdate(ip);
+  if(ip->nlink == 0 && ip->hasimg)
+    imginval(ip);  // let go of it so the file can be freed
   iunlockput(ip);
 
   end_op();
@@ -401,19 +487,19 @@ sys_chdir(void)
   return 0;
 }
 
-int
-sys_exec(void)
+// Fetch the nth system call argument as a null-terminated
+// array of at most MAXARG strings into argv.
+static int
+argargv(int n, char **argv)
 {
-  char *path, *argv[MAXARG];
   int i;
   uint uargv, uarg;
 
-  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
+  if(argint(n, (int*)&uargv) < 0)
     return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv))
+    if(i >= MAXARG)
       return -1;
     if(fetchint(uargv+4*i, (int*)&uarg) < 0)
       return -1;
@@ -424,9 +510,46 @@ sys_exec(void)
     if(fetchstr(uarg, &argv[i]) < 0)
       return -1;
   }
+  return 0;
+}
+
+int
+sys_exec(void)
+{
+  char *path, *argv[MAXARG];
+
+  if(argstr(0, &path) < 0 || argargv(1, argv) < 0){
+    return -1;
+  }
   return exec(path, argv);
 }
 
+// Start the program at path with arguments argv in a new
+// process.  fds[i] names the caller's descriptor that becomes
+// the child's descriptor i, or -1 for none; if fds is null
+// the child gets the caller's 0, 1 and 2.
+int
+sys_spawn(void)
+{
+  char *path, *argv[MAXARG];
+  struct file *f[3];
+  struct proc *curproc = myproc();
+  int i, ufds, *fds;
+
+  if(argstr(0, &path) < 0 || argargv(1, argv) < 0 || argint(2, &ufds) < 0)
+    return -1;
+  if(ufds != 0 && argptr(2, (void*)&fds, 3*sizeof(fds[0])) < 0)
+    return -1;
+  for(i = 0; i < 3; i++){
+    f[i] = ufds ? 0 : curproc->ofile[i];
+    if(ufds == 0 || fds[i] < 0)
+      continue;
+    if(fds[i] >= curproc->nofile || (f[i] = curproc->ofile[fds[i]]) == 0)
+      return -1;
+  }
+  return spawn(path, argv, f);
+}
+
 int
 sys_pipe(void)
 {
@@ -441,7 +564,7 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
+      fdremove(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -451,12 +574,28 @@ sys_pipe(void)
   return 0;
 }
 
+// Resize the ring behind pipe descriptor fd to n bytes;
+// n == 0 returns the current size.
+int
+sys_pipesize(void)
+{
+  struct file *f;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(f->type != FD_PIPE)
+    return -1;
+  return piperesize(f->pipe, n);
+}
+
 int sys_swapread(void)
 {
 	char* ptr;
 	int blkno;
 
-	if(argptr(0, &ptr, PGSIZE) < 0 || argint(1, &blkno) < 0 )
+	if(argptr(0, &ptr, PGSIZE) < 0 || argint(1, &blkno) < 0 ||
+	   prefault((uint)ptr, PGSIZE, 1) < 0)
 		return -1;
 
 	swapread(ptr, blkno);
@@ -468,7 +607,8 @@ int sys_swapwrite(void)
 	char* ptr;
 	int blkno;
 
-	if(argptr(0, &ptr, PGSIZE) < 0 || argint(1, &blkno) < 0 )
+	if(argptr(0, &ptr, PGSIZE) < 0 || argint(1, &blkno) < 0 ||
+	   prefault((uint)ptr, PGSIZE, 0) < 0)
 		return -1;
 
 	swapwrite(ptr, blkno);
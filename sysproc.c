@@ -6,6 +6,8 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "memstat.h"
+#include "lockstat.h"
 
 int
 sys_fork(void)
@@ -51,13 +53,9 @@ sys_sbrk(void)
   if(argint(0, &n) < 0)
     return -1;
 
-  struct proc *p = myproc();
   addr = myproc()->sz;
-
-  // if(growproc(n) < 0) return -1;
-  // no longer allocate pages immediately
-
-  p->sz +=n;
+  if(growproc(n) < 0)
+    return -1;
   return addr;
 }
 
@@ -65,21 +63,10 @@ int
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return sleepticks(n);
 }
 
 // return how many clock tick interrupts have occurred
@@ -95,6 +82,45 @@ sys_uptime(void)
   return xticks;
 }
 
+// Time since boot, to the nanosecond.
+int
+sys_clocktime(void)
+{
+  struct timespec *ts;
+
+  if(argptr(0, (char**)&ts, sizeof(*ts)) < 0)
+    return -1;
+  clocktime(ts);
+  return 0;
+}
+
+// Report free physical memory by buddy order.
+int
+sys_memstat(void)
+{
+  struct memstat *st;
+
+  if(argptr(0, (char**)&st, sizeof(*st)) < 0 ||
+     prefault((uint)st, sizeof(*st), 1) < 0)
+    return -1;
+  kmemstat(st);
+  return 0;
+}
+
+// Copy out up to n entries of spin lock statistics.
+int
+sys_lockstat(void)
+{
+  struct lockstat *st;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0 || n > NLOCKSTAT)
+    return -1;
+  if(argptr(0, (char**)&st, n*sizeof(*st)) < 0)
+    return -1;
+  return klockstat(st, n);
+}
+
 int 
 sys_nice(void)
 {
@@ -168,7 +194,9 @@ sys_mutex_lock(void)
 {
   void *l;
 
-  if(argptr(0,(char**)&l, sizeof(int) < 0)) return -1;
+  // The lock word is used under ptable.lock.
+  if(argptr(0,(char**)&l, sizeof(int)) < 0 ||
+     prefault((uint)l, sizeof(int), 1) < 0) return -1;
 
   return mutex_lock(l);
 }
@@ -178,7 +206,9 @@ sys_mutex_unlock(void)
 {
   void *l;
 
-  if(argptr(0,(char**)&l, sizeof(int) < 0)) return -1;
+  // The lock word is used under ptable.lock.
+  if(argptr(0,(char**)&l, sizeof(int)) < 0 ||
+     prefault((uint)l, sizeof(int), 1) < 0) return -1;
 
   return mutex_unlock(l);
 }
\ No newline at end of file
@@ -0,0 +1,236 @@
+// Thread pool: a fixed set of clone()d worker threads that
+// run small tasks, so that fine-grained parallel work does not
+// pay for a clone(), exit() and join() per task.
+//
+// Each worker has a deque of tasks.  A thread pushes the tasks
+// it submits on the bottom of its own deque and pops them from
+// there too, newest first; an idle worker steals the oldest
+// task from the top of another deque.  Threads outside the pool
+// share one extra deque.  tpool_wait() runs queued tasks until
+// its group is done, so tasks may submit and wait on tasks of
+// their own.
+//
+// Workers are told apart by their stacks, which is why each
+// worker's stack comes from one block allocated here.
+
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+#include "tpool.h"
+
+#define PGSIZE   4096
+#define TPSTACK  (4*PGSIZE)  // worker stack block, with room to align
+
+struct task {
+  void (*fn)(void*);
+  void *arg;
+  struct tpgroup *g;
+};
+
+struct deque {
+  uint lock;
+  uint top;   // next task to steal
+  uint bot;   // next free slot
+  struct task task[TPDEQUE];
+};
+
+static struct {
+  int n;                    // workers running
+  volatile int stop;        // workers should exit
+  volatile int starting;    // worker being started
+  volatile int nstarted;
+  char *stack[TPMAXWORK];
+  struct deque q[TPMAXWORK+1];  // q[n] is for threads outside the pool
+} pool;
+
+static void
+lock(uint *l)
+{
+  while(xchg(l, 1) != 0)
+    yield();
+}
+
+static void
+unlock(uint *l)
+{
+  xchg(l, 0);
+}
+
+static int
+fetchadd(volatile int *p, int v)
+{
+  asm volatile("lock; xaddl %0, %1" : "+r" (v), "+m" (*p) : : "memory");
+  return v;
+}
+
+// Index of the calling thread's deque.
+static int
+self(void)
+{
+  uint sp;
+  int i;
+
+  sp = (uint)&sp;
+  for(i = 0; i < pool.n; i++)
+    if(sp >= (uint)pool.stack[i] && sp < (uint)pool.stack[i] + TPSTACK)
+      return i;
+  return pool.n;
+}
+
+// Newest task on the caller's own deque.
+static int
+take(int id, struct task *t)
+{
+  struct deque *q = &pool.q[id];
+  int ok;
+
+  lock(&q->lock);
+  if((ok = q->bot != q->top) != 0)
+    *t = q->task[--q->bot % TPDEQUE];
+  unlock(&q->lock);
+  return ok;
+}
+
+// Oldest task on some other deque.
+static int
+steal(int id, struct task *t)
+{
+  struct deque *q;
+  int i, ok;
+
+  for(i = 1; i <= pool.n; i++){
+    q = &pool.q[(id + i) % (pool.n + 1)];
+    if(q->bot == q->top)
+      continue;
+    lock(&q->lock);
+    if((ok = q->bot != q->top) != 0)
+      *t = q->task[q->top++ % TPDEQUE];
+    unlock(&q->lock);
+    if(ok)
+      return 1;
+  }
+  return 0;
+}
+
+static void
+run(struct task *t)
+{
+  t->fn(t->arg);
+  fetchadd(&t->g->pending, -1);
+}
+
+static void worker(int) __attribute__((noinline));
+static int startworker(char*) __attribute__((noinline));
+
+static void
+worker(int id)
+{
+  struct task t;
+
+  fetchadd(&pool.nstarted, 1);
+  while(!pool.stop){
+    if(take(id, &t) || steal(id, &t))
+      run(&t);
+    else
+      yield();
+  }
+}
+
+// The new thread starts on a copy of the caller's stack page,
+// with %ebp perhaps pointing past it, so it must not touch
+// any locals before worker() sets up a frame of its own.  It
+// finds its index in pool.starting.
+static int
+startworker(char *stack)
+{
+  int tid;
+
+  if((tid = clone(stack)) == 0){
+    worker(pool.starting);
+    exit();
+  }
+  return tid;
+}
+
+// Start n workers.  Returns 0, or -1 if none could be started.
+int
+tpool_init(int n)
+{
+  char *s;
+
+  if(pool.n > 0)
+    return -1;
+  if(n > TPMAXWORK)
+    n = TPMAXWORK;
+  pool.stop = 0;
+  pool.nstarted = 0;
+  while(pool.n < n){
+    if((s = malloc(TPSTACK)) == 0)
+      break;
+    pool.starting = pool.n;
+    // clone() wants a page; the thread's stack grows down
+    // from inside it into the pages below.
+    if(startworker((char*)(((uint)s + PGSIZE - 1) & ~(PGSIZE-1)) + 2*PGSIZE) < 0){
+      free(s);
+      break;
+    }
+    pool.stack[pool.n++] = s;
+    while(pool.nstarted < pool.n)
+      yield();
+  }
+  return pool.n > 0 ? 0 : -1;
+}
+
+// Queue fn(arg) to run as part of group g.
+void
+tpool_submit(struct tpgroup *g, void (*fn)(void*), void *arg)
+{
+  struct deque *q;
+  struct task t;
+
+  t.fn = fn;
+  t.arg = arg;
+  t.g = g;
+  fetchadd(&g->pending, 1);
+  q = &pool.q[self()];
+  lock(&q->lock);
+  if(pool.n == 0 || q->bot - q->top == TPDEQUE){
+    unlock(&q->lock);
+    run(&t);
+    return;
+  }
+  q->task[q->bot++ % TPDEQUE] = t;
+  unlock(&q->lock);
+}
+
+// Run tasks until every task in g has finished.
+void
+tpool_wait(struct tpgroup *g)
+{
+  struct task t;
+  int id;
+
+  id = self();
+  while(g->pending > 0){
+    if(take(id, &t) || steal(id, &t))
+      run(&t);
+    else
+      yield();
+  }
+}
+
+// Stop the workers.  Tasks still queued are not run.
+void
+tpool_exit(void)
+{
+  int i;
+
+  pool.stop = 1;
+  for(i = 0; i < pool.n; i++)
+    join();
+  for(i = 0; i < pool.n; i++)
+    free(pool.stack[i]);
+  for(i = 0; i <= TPMAXWORK; i++)
+    pool.q[i].top = pool.q[i].bot = 0;
+  pool.n = 0;
+}
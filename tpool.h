@@ -0,0 +1,8 @@
+// Thread pool for user programs; see tpool.c.
+#define TPMAXWORK 8     // most worker threads
+#define TPDEQUE   256   // tasks queued per worker before submit runs them inline
+
+// A set of tasks to wait for together.  Zero it before use.
+struct tpgroup {
+  volatile int pending;  // tasks submitted and not yet finished
+};
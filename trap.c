@@ -18,6 +18,58 @@ extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
 
+// A process in sleepticks(), on a list ordered by deadline,
+// so that each tick wakes only the sleepers whose time is up.
+struct sleeper {
+  uint deadline;
+  int done;
+  struct sleeper *next;
+};
+static struct sleeper *sleepers;  // guarded by tickslock
+
+// Sleep for n clock ticks.  Returns -1 if killed first.
+int
+sleepticks(int n)
+{
+  struct sleeper s, **pp;
+
+  if(n <= 0)
+    return 0;
+  acquire(&tickslock);
+  s.deadline = ticks + n;
+  s.done = 0;
+  for(pp = &sleepers; *pp && (int)((*pp)->deadline - s.deadline) <= 0; pp = &(*pp)->next)
+    ;
+  s.next = *pp;
+  *pp = &s;
+  while(!s.done){
+    if(myproc()->killed){
+      for(pp = &sleepers; *pp != &s; pp = &(*pp)->next)
+        ;
+      *pp = s.next;
+      release(&tickslock);
+      return -1;
+    }
+    sleep(&s, &tickslock);
+  }
+  release(&tickslock);
+  return 0;
+}
+
+// Wake the sleepers whose deadline has come.
+// Caller holds tickslock.
+static void
+sleepexpire(void)
+{
+  struct sleeper *s;
+
+  while((s = sleepers) != 0 && (int)(ticks - s->deadline) >= 0){
+    sleepers = s->next;
+    s->done = 1;
+    wakeup(s);
+  }
+}
+
 void
 tvinit(void)
 {
@@ -49,80 +101,12 @@ trap(struct trapframe *tf)
       exit();
     return;
   }
-  else if(tf->trapno == T_PGFLT){
-    struct proc *p = myproc();
-    uint va = rcr2(); // cr2 register contains a faulted virtual address
-
-    if(va >= KERNBASE){
-      p->killed = 1;
-      return;
-    }
-
-    struct mmap_page *m = 0;
-    for(int i=0; i<4; i++){
-      if(p->mmaps[i].used && va >= p->mmaps[i].addr && va < p->mmaps[i].addr + p->mmaps[i].length){
-        m = &p->mmaps[i];
-        break;
-      }
-    }
-
-    if(m){
-      if((tf->err & 2) && !(m->prot & MAP_PROT_WRITE)){
-        cprintf("mmap write protection\n");
-        p->killed = 1;
-        return;
-      }
-
-      char *mem = kalloc();
-      if(mem == 0){
-        p->killed = 1;
-        return;
-      }
-      memset(mem,0,PGSIZE);
-
-      uint va_start = PGROUNDDOWN(va);
-      int offset = (va_start - m->addr) + m->offset;
-      int n = PGSIZE;
-      if(va_start + n > m->addr + m->length) n = (m->addr + m->length) - va_start;
-
-      ilock(m->f->ip);
-      readi(m->f->ip, mem, offset, n); 
-      iunlock(m->f->ip);
 
-      int perm = PTE_U | PTE_P;
-      if(m->prot & MAP_PROT_WRITE) perm |= PTE_W;
-
-      if(mappages(p->pgdir, (void*)va_start, PGSIZE, V2P(mem), perm) < 0){
-        kfree(mem);
-        p->killed = 1;
-      }
-      return; 
-    }
-
-    if(tf->err &1){ //p bit t-err는 페이지는 있지만 권한문제
-      p->killed = 1;
-      return;
-    }
-
-
-    if(va < p->sz){
-      char *mem = kalloc();
-      if(mem ==0){
-        p->killed = 1;
-        return;
-      }
-      memset(mem,0,PGSIZE);
-
-      if(mappages(p->pgdir, (void*)PGROUNDDOWN(va), PGSIZE, V2P(mem), PTE_W|PTE_U|PTE_P) < 0){
-        kfree(mem);
-        p->killed = 1;
-      }
-
-      return;
-    }
-
-
-  }
+  // Demand paging; a fault that pagefault() cannot resolve
+  // falls through to the default case below.
+  if(tf->trapno == T_PGFLT &&
+     pagefault(rcr2(), tf->err & 2, (tf->cs&3) == DPL_USER) == 0)
+    return;
 
   switch(tf->trapno){
   // kernel/trap.c
@@ -132,7 +116,10 @@ trap(struct trapframe *tf)
       acquire(&tickslock);
       ticks++;
       wakeup(&ticks);
+      sleepexpire();
+      polltick();
       release(&tickslock);
+      rcupoll();
     }
 
     if(myproc() && myproc()->state == RUNNING){
@@ -153,6 +140,14 @@ trap(struct trapframe *tf)
       }
     }
     break;
+  case T_TLBFLUSH:
+    tlbintr();
+    lapiceoi();
+    break;
+  case T_WAKEUP:
+    // The scheduler looks for work once hlt returns.
+    lapiceoi();
+    break;
   case T_IRQ0 + IRQ_IDE:
     ideintr();
     lapiceoi();
@@ -195,6 +190,11 @@ trap(struct trapframe *tf)
     myproc()->killed = 1;
   }
 
+  // Give back the pages kswapd asked for, now that no system
+  // call of this process is using them.
+  if(myproc() && myproc()->swapwant && (tf->cs&3) == DPL_USER)
+    swapself(myproc()->swapwant);
+
   // Force process exit if it has been killed and is in user space.
   // (If it is still executing in the kernel, let it keep running
   // until it gets to the regular system call return.)
@@ -14,15 +14,31 @@
 
 #define COM1    0x3f8
 
+#define TXBUF   1024  // bytes queued for transmission
+
 static int uart;    // is there a uart?
 
+// Output waits in tx.buf; the transmitter-empty interrupt
+// feeds it to the UART, a FIFO-full at a time, so writers
+// need not wait for the line.
+static struct {
+  struct spinlock lock;
+  char buf[TXBUF];
+  uint r;     // next byte to send
+  uint w;     // next free slot
+  int fifo;   // bytes the UART takes at once
+  int ier;    // interrupts enabled
+} tx;
+
 void
 uartinit(void)
 {
   char *p;
 
-  // Turn off the FIFO
-  outb(COM1+2, 0);
+  initlock(&tx.lock, "uart");
+
+  // Turn on and clear the FIFOs, if the UART has them.
+  outb(COM1+2, 0x07);
 
   // 9600 baud, 8 data bits, 1 stop bit, parity off.
   outb(COM1+3, 0x80);    // Unlock divisor
@@ -30,7 +46,8 @@ uartinit(void)
   outb(COM1+1, 0);
   outb(COM1+3, 0x03);    // Lock divisor, 8 data bits.
   outb(COM1+4, 0);
-  outb(COM1+1, 0x01);    // Enable receive interrupts.
+  tx.ier = 0x01;
+  outb(COM1+1, tx.ier);  // Enable receive interrupts.
 
   // If status is 0xFF, no serial port.
   if(inb(COM1+5) == 0xFF)
@@ -39,7 +56,7 @@ uartinit(void)
 
   // Acknowledge pre-existing interrupt conditions;
   // enable interrupts.
-  inb(COM1+2);
+  tx.fifo = (inb(COM1+2) & 0xC0) == 0xC0 ? 16 : 1;
   inb(COM1+0);
   ioapicenable(IRQ_COM1, 0);
 
@@ -48,8 +65,28 @@ uartinit(void)
     uartputc(*p);
 }
 
+// Hand the UART as much queued output as it will take, and
+// ask for an interrupt when it wants more.  Caller holds
+// tx.lock.
+static void
+uartstart(void)
+{
+  int i, ier;
+
+  if(inb(COM1+5) & 0x20)
+    for(i = 0; i < tx.fifo && tx.r != tx.w; i++)
+      outb(COM1+0, tx.buf[tx.r++ % TXBUF]);
+  ier = tx.r != tx.w ? 0x03 : 0x01;
+  if(ier != tx.ier){
+    tx.ier = ier;
+    outb(COM1+1, ier);
+  }
+}
+
+// Send one byte now, waiting for the line if need be.
+// For panic(), and for before the console is set up.
 void
-uartputc(int c)
+uartputcsync(int c)
 {
   int i;
 
@@ -60,6 +97,49 @@ uartputc(int c)
   outb(COM1+0, c);
 }
 
+// Queue one byte.  Never sleeps, so it serves cprintf() and
+// echo from interrupt handlers; if the queue is full it sends
+// the oldest byte itself.
+void
+uartputc(int c)
+{
+  if(!uart)
+    return;
+  acquire(&tx.lock);
+  if(tx.w - tx.r == TXBUF)
+    uartputcsync(tx.buf[tx.r++ % TXBUF]);
+  tx.buf[tx.w++ % TXBUF] = c;
+  uartstart();
+  release(&tx.lock);
+}
+
+// Queue n bytes from kernel memory, sleeping while the
+// queue is full.
+void
+uartwrite(char *s, int n)
+{
+  int i;
+
+  if(!uart)
+    return;
+  acquire(&tx.lock);
+  for(i = 0; i < n; i++){
+    while(tx.w - tx.r == TXBUF){
+      uartstart();
+      if(tx.w - tx.r < TXBUF)
+        break;
+      if(myproc()->killed){
+        release(&tx.lock);
+        return;
+      }
+      sleep(&tx.r, &tx.lock);
+    }
+    tx.buf[tx.w++ % TXBUF] = s[i];
+  }
+  uartstart();
+  release(&tx.lock);
+}
+
 static int
 uartgetc(void)
 {
@@ -73,5 +153,10 @@ uartgetc(void)
 void
 uartintr(void)
 {
+  acquire(&tx.lock);
+  uartstart();
+  if(tx.w - tx.r < TXBUF)
+    wakeup(&tx.r);
+  release(&tx.lock);
   consoleintr(uartgetc);
 }
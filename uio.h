@@ -0,0 +1,8 @@
+// Scatter/gather buffers for readv() and writev(), shared by
+// the kernel and user programs.
+#define IOV_MAX 16  // most buffers in one call
+
+struct iovec {
+  void *iov_base;  // start of buffer
+  uint iov_len;    // its length in bytes
+};
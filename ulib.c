@@ -11,6 +11,56 @@ struct{
   int used;
 } joined_threads[MAX_THREADS];
 
+int _fork(void);
+int _exit(void) __attribute__((noreturn));
+int _exec(char*, char**);
+
+// Set by printf() once it holds buffered output, which must
+// be written before the process exits, forks or execs so that
+// it is neither lost nor printed twice.
+void (*stdioflush)(void);
+
+int
+fork(void)
+{
+  if(stdioflush)
+    stdioflush();
+  return _fork();
+}
+
+int
+exit(void)
+{
+  if(stdioflush)
+    stdioflush();
+  _exit();
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(stdioflush)
+    stdioflush();
+  return _exec(path, argv);
+}
+
+// Input for gets(), read a buffer at a time when fd 0 is the
+// console.  A console read stops at the end of a line, so this
+// never holds input past the line gets() returns.
+static struct {
+  int n;     // bytes in buf
+  int off;   // next byte to return
+  char buf[512];
+} in;
+
+// The string and memory routines below work a 32-bit word at
+// a time where they can.  An aligned word never crosses into
+// the next page, so reading one that holds the end of a
+// string is safe.
+
+// Whether any byte of w is zero.
+#define HASZERO(w) (((w) - 0x01010101) & ~(w) & 0x80808080)
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -25,6 +75,13 @@ strcpy(char *s, const char *t)
 int
 strcmp(const char *p, const char *q)
 {
+  if(((uint)p & 3) == ((uint)q & 3)){
+    for(; (uint)p & 3; p++, q++)
+      if(*p == 0 || *p != *q)
+        return (uchar)*p - (uchar)*q;
+    while(*(uint*)p == *(uint*)q && !HASZERO(*(uint*)p))
+      p += 4, q += 4;
+  }
   while(*p && *p == *q)
     p++, q++;
   return (uchar)*p - (uchar)*q;
@@ -33,23 +90,56 @@ strcmp(const char *p, const char *q)
 uint
 strlen(const char *s)
 {
-  int n;
+  const char *p;
 
-  for(n = 0; s[n]; n++)
-    ;
-  return n;
+  for(p = s; (uint)p & 3; p++)
+    if(*p == 0)
+      return p - s;
+  while(!HASZERO(*(uint*)p))
+    p += 4;
+  while(*p)
+    p++;
+  return p - s;
 }
 
 void*
 memset(void *dst, int c, uint n)
 {
-  stosb(dst, c, n);
+  char *d;
+  uint k;
+
+  d = dst;
+  c &= 0xFF;
+  if(n >= 16){
+    k = -(uint)d & 3;
+    stosb(d, c, k);
+    d += k;
+    n -= k;
+    stosl(d, (c<<24)|(c<<16)|(c<<8)|c, n/4);
+    d += n & ~3;
+    n &= 3;
+  }
+  stosb(d, c, n);
   return dst;
 }
 
 char*
 strchr(const char *s, char c)
 {
+  uint cc, w;
+
+  for(; (uint)s & 3; s++){
+    if(*s == 0)
+      return 0;
+    if(*s == c)
+      return (char*)s;
+  }
+  cc = (uchar)c * 0x01010101;
+  for(;; s += 4){
+    w = *(uint*)s;
+    if(HASZERO(w) || HASZERO(w ^ cc))
+      break;
+  }
   for(; *s; s++)
     if(*s == c)
       return (char*)s;
@@ -59,13 +149,27 @@ strchr(const char *s, char c)
 char*
 gets(char *buf, int max)
 {
-  int i, cc;
+  int i, cc, n;
   char c;
+  struct stat st;
 
+  // Show any prompt before waiting for input.
+  if(stdioflush)
+    stdioflush();
+  // From a pipe or file, read a byte at a time, so that
+  // children the caller starts find the rest of the input.
+  n = 1;
+  if(fstat(0, &st) == 0 && st.type == T_DEV)
+    n = sizeof(in.buf);
   for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
-      break;
+    if(in.off == in.n){
+      cc = read(0, in.buf, n);
+      if(cc < 1)
+        break;
+      in.n = cc;
+      in.off = 0;
+    }
+    c = in.buf[in.off++];
     buf[i++] = c;
     if(c == '\n' || c == '\r')
       break;
@@ -104,11 +208,40 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  uint *dw;
+  const uint *sw;
+  int k;
 
+  if(n <= 0)
+    return vdst;
   dst = vdst;
   src = vsrc;
-  while(n-- > 0)
-    *dst++ = *src++;
+  if(src < dst && src + n > dst){
+    src += n;
+    dst += n;
+    if(n >= 16)
+      for(k = (uint)dst & 3; k > 0; k--, n--)
+        *--dst = *--src;
+    dw = (uint*)dst;
+    sw = (const uint*)src;
+    for(k = n/4; k > 0; k--)
+      *--dw = *--sw;
+    dst = (char*)dw;
+    src = (const char*)sw;
+    n &= 3;
+    while(n-- > 0)
+      *--dst = *--src;
+  } else {
+    if(n >= 16){
+      k = -(uint)dst & 3;
+      movsb(dst, src, k);
+      dst += k;
+      src += k;
+      n -= k;
+    }
+    movsl(dst, src, n/4);
+    movsb(dst + (n & ~3), src + (n & ~3), n & 3);
+  }
   return vdst;
 }
 
@@ -2,89 +2,195 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "x86.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator, safe to call from threads sharing an
+// address space.
+//
+// Memory comes from sbrk() in page-aligned chunks, each with
+// a header in its first 16 bytes.  A request of up to 1024
+// bytes is rounded up to a size class and served from a
+// chunk of one page holding objects of that class only, from
+// a per-class free list, in constant time.  Larger requests
+// get a chunk of their own.
+//
+// Small objects live in NARENA arenas, each with its own
+// lock and free lists.  A thread uses the arena its stack
+// address picks, so threads with different stacks mostly
+// stay out of each other's way.  A freed object goes back to
+// the arena its page came from.  Free chunks are kept in one
+// address-ordered list, merged with their neighbours.
 
-typedef long Align;
+#define PGSIZE  4096
+#define NCLASS  7      // size classes 16, 32, ..., 1024 bytes
+#define NARENA  4
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
+struct arena;
+
+// At the start of every chunk.
+struct chunk {
+  uint npage;           // pages in the chunk
+  int class;            // size class, or -1 for one large block
+  struct arena *arena;  // owner of a page of small objects
+  struct chunk *next;   // next free chunk, while free
 };
 
-typedef union header Header;
+struct object {
+  struct object *next;
+};
 
-static Header base;
-static Header *freep;
+struct arena {
+  uint lock;
+  struct object *bin[NCLASS];
+};
 
-void
-free(void *ap)
+static struct arena arenas[NARENA];
+
+static struct {
+  uint lock;
+  struct chunk *free;   // free chunks, by address
+} core;
+
+static void
+lock(uint *l)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
+  while(xchg(l, 1) != 0)
+    yield();
+}
+
+static void
+unlock(uint *l)
+{
+  xchg(l, 0);
+}
+
+// Put c on the free list, merging it with free chunks on
+// either side.  Caller holds core.lock.
+static void
+putchunk(struct chunk *c)
+{
+  struct chunk *p, *prev;
+
+  prev = 0;
+  for(p = core.free; p != 0 && p < c; p = p->next)
+    prev = p;
+  c->next = p;
+  if(p && (char*)c + c->npage*PGSIZE == (char*)p){
+    c->npage += p->npage;
+    c->next = p->next;
+  }
+  if(prev == 0)
+    core.free = c;
+  else if((char*)prev + prev->npage*PGSIZE == (char*)c){
+    prev->npage += c->npage;
+    prev->next = c->next;
   } else
-    p->s.ptr = bp;
-  freep = p;
+    prev->next = c;
 }
 
-static Header*
-morecore(uint nu)
+// A chunk of npage pages, from the free list or sbrk().
+static struct chunk*
+getchunk(uint npage)
 {
+  struct chunk *c, **pp;
   char *p;
-  Header *hp;
+  uint pad;
+
+  lock(&core.lock);
+  for(pp = &core.free; (c = *pp) != 0; pp = &c->next){
+    if(c->npage < npage)
+      continue;
+    if(c->npage == npage)
+      *pp = c->next;
+    else {
+      // Hand out the tail; the head stays on the list.
+      c->npage -= npage;
+      c = (struct chunk*)((char*)c + c->npage*PGSIZE);
+    }
+    unlock(&core.lock);
+    c->npage = npage;
+    return c;
+  }
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+  // Others may have moved the break off a page boundary.
+  p = sbrk(0);
+  pad = (PGSIZE - (uint)p % PGSIZE) % PGSIZE;
+  if(npage > (0x80000000 - pad) / PGSIZE ||
+     (p = sbrk(pad + npage*PGSIZE)) == (char*)-1){
+    unlock(&core.lock);
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  }
+  unlock(&core.lock);
+  c = (struct chunk*)(p + pad);
+  c->npage = npage;
+  return c;
+}
+
+void
+free(void *ap)
+{
+  struct chunk *c;
+  struct object *o;
+  struct arena *a;
+
+  if(ap == 0)
+    return;
+  c = (struct chunk*)((uint)ap & ~(PGSIZE-1));
+  if(c->class < 0){
+    lock(&core.lock);
+    putchunk(c);
+    unlock(&core.lock);
+    return;
+  }
+  o = ap;
+  a = c->arena;
+  lock(&a->lock);
+  o->next = a->bin[c->class];
+  a->bin[c->class] = o;
+  unlock(&a->lock);
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct arena *a;
+  struct chunk *c;
+  struct object *o;
+  uint size;
+  int cls;
+  char *p;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
+  if(nbytes > 16 << (NCLASS-1)){
+    if(nbytes > 0x80000000)
+      return 0;
+    if((c = getchunk((nbytes + sizeof(*c) + PGSIZE-1) / PGSIZE)) == 0)
+      return 0;
+    c->class = -1;
+    c->arena = 0;
+    return c + 1;
   }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
+
+  for(cls = 0; 16 << cls < nbytes; cls++)
+    ;
+  a = &arenas[((uint)&a / PGSIZE) % NARENA];
+  lock(&a->lock);
+  if((o = a->bin[cls]) == 0){
+    // Carve a new page into objects of this class.
+    if((c = getchunk(1)) == 0){
+      unlock(&a->lock);
+      return 0;
+    }
+    c->class = cls;
+    c->arena = a;
+    size = 16 << cls;
+    for(p = (char*)c + PGSIZE - size; p >= (char*)(c + 1); p -= size){
+      o = (struct object*)p;
+      o->next = a->bin[cls];
+      a->bin[cls] = o;
     }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+    o = a->bin[cls];
   }
+  a->bin[cls] = o->next;
+  unlock(&a->lock);
+  return o;
 }
@@ -1,5 +1,11 @@
 struct stat;
 struct rtcdate;
+struct pollfd;
+struct iovec;
+struct memstat;
+struct lockstat;
+struct tpgroup;
+struct timespec;
 
 // system calls
 int fork(void);
@@ -35,6 +41,17 @@ int clone(void*);
 int join(void);
 int mutex_lock(int*);
 int mutex_unlock(int*);
+int splice(int, int, int);
+int pipesize(int, int);
+int poll(struct pollfd*, int, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int spawn(char*, char**, int*);
+int memstat(struct memstat*);
+int clocktime(struct timespec*);
+int lockstat(struct lockstat*, int);
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
@@ -42,6 +59,7 @@ void *memmove(void*, const void*, int);
 char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void printf(int, const char*, ...);
+void fflush(int);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
@@ -49,4 +67,10 @@ void* malloc(uint);
 void free(void*);
 int atoi(const char*);
 int thread_create(void(*)(void *), void *);
-int thread_join(int);
\ No newline at end of file
+int thread_join(int);
+
+// tpool.c
+int tpool_init(int);
+void tpool_submit(struct tpgroup*, void(*)(void*), void*);
+void tpool_wait(struct tpgroup*);
+void tpool_exit(void);
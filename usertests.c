@@ -4,9 +4,15 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "poll.h"
+#include "uio.h"
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "memstat.h"
+#include "tpool.h"
+#include "date.h"
+#include "lockstat.h"
 
 char buf[8192];
 char name[3];
@@ -354,6 +360,577 @@ pipe1(void)
   printf(1, "pipe1 ok\n");
 }
 
+// a resized pipe must hold that much data without a reader
+void
+pipesizetest(void)
+{
+  int fds[2], i, n;
+
+  printf(1, "pipesize test\n");
+  if(pipe(fds) != 0){
+    printf(1, "pipesize: pipe() failed\n");
+    exit();
+  }
+  if(pipesize(fds[0], 0) < 512){
+    printf(1, "pipesize: default too small\n");
+    exit();
+  }
+  if(pipesize(fds[1], 5000) != 8192){
+    printf(1, "pipesize: resize failed\n");
+    exit();
+  }
+  for(i = 0; i < 8192; i++)
+    buf[i] = i * 7;
+  if(write(fds[1], buf, 8192) != 8192){
+    printf(1, "pipesize: write failed\n");
+    exit();
+  }
+  if(pipesize(fds[1], 4096) >= 0){
+    printf(1, "pipesize: shrank a full pipe\n");
+    exit();
+  }
+  memset(buf, 0, 8192);
+  for(i = 0; i < 8192; i += n){
+    if((n = read(fds[0], buf + i, 8192 - i)) <= 0){
+      printf(1, "pipesize: read failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 8192; i++){
+    if((buf[i] & 0xff) != ((i * 7) & 0xff)){
+      printf(1, "pipesize: wrong data\n");
+      exit();
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  printf(1, "pipesize test ok\n");
+}
+
+// wait on two pipes at once
+void
+polltest(void)
+{
+  struct pollfd fds[2];
+  int a[2], b[2], pid;
+  char c;
+
+  printf(1, "poll test\n");
+  if(pipe(a) != 0 || pipe(b) != 0){
+    printf(1, "poll: pipe() failed\n");
+    exit();
+  }
+  fds[0].fd = a[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = b[0];
+  fds[1].events = POLLIN;
+  if(poll(fds, 2, 0) != 0 || poll(fds, 2, 2) != 0){
+    printf(1, "poll: empty pipes ready\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "poll: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    sleep(5);
+    write(b[1], "x", 1);
+    exit();
+  }
+  if(poll(fds, 2, -1) != 1 || fds[0].revents != 0 ||
+     (fds[1].revents & POLLIN) == 0){
+    printf(1, "poll: missed write\n");
+    exit();
+  }
+  if(read(b[0], &c, 1) != 1 || c != 'x'){
+    printf(1, "poll: wrong data\n");
+    exit();
+  }
+  wait();
+  close(b[1]);
+  if(poll(fds+1, 1, 0) != 1 || (fds[1].revents & POLLHUP) == 0){
+    printf(1, "poll: no hangup\n");
+    exit();
+  }
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  printf(1, "poll test ok\n");
+}
+
+// splice a file into a pipe and check what comes out
+void
+splicetest(void)
+{
+  int fds[2], fd, pid, i, n, total;
+
+  printf(1, "splice test\n");
+  unlink("splice.data");
+  fd = open("splice.data", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "splice: create failed\n");
+    exit();
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  for(i = 0; i < 5; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "splice: write failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  if(pipe(fds) != 0){
+    printf(1, "splice: pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "splice: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fd = open("splice.data", O_RDONLY);
+    if(splice(fd, fds[1], 5*sizeof(buf) + 100) != 5*sizeof(buf)){
+      printf(1, "splice: short splice\n");
+      exit();
+    }
+    if(splice(fd, fds[1], 10) != 0){
+      printf(1, "splice: no eof\n");
+      exit();
+    }
+    exit();
+  }
+  close(fds[1]);
+  total = 0;
+  while((n = read(fds[0], buf, 1000)) > 0){
+    for(i = 0; i < n; i++){
+      if((buf[i] & 0xff) != ((total + i) % sizeof(buf) & 0xff)){
+        printf(1, "splice: wrong data\n");
+        exit();
+      }
+    }
+    total += n;
+  }
+  close(fds[0]);
+  wait();
+  if(total != 5*sizeof(buf)){
+    printf(1, "splice: total %d\n", total);
+    exit();
+  }
+  unlink("splice.data");
+  printf(1, "splice test ok\n");
+}
+
+// readv/writev gather and scatter in order; pread/pwrite
+// use their own offset and leave the file offset alone.
+void
+iovtest(void)
+{
+  struct iovec iov[3];
+  char a[5], b[8];
+  int fd, i;
+
+  printf(1, "iov test\n");
+  unlink("iov.data");
+  fd = open("iov.data", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(1, "iov: create failed\n");
+    exit();
+  }
+  iov[0].iov_base = "abc";
+  iov[0].iov_len = 3;
+  iov[1].iov_base = "";
+  iov[1].iov_len = 0;
+  iov[2].iov_base = "defghij";
+  iov[2].iov_len = 7;
+  if(writev(fd, iov, 3) != 10){
+    printf(1, "iov: writev failed\n");
+    exit();
+  }
+  memset(b, 0, sizeof(b));
+  if(pwrite(fd, "XY", 2, 4) != 2 || pread(fd, b, 4, 3) != 4 ||
+     strcmp(b, "dXYg") != 0){
+    printf(1, "iov: pread/pwrite wrong\n");
+    exit();
+  }
+  // offset is still at the end
+  memset(b, 0, sizeof(b));
+  if(write(fd, "k", 1) != 1 || pread(fd, b, 7, 8) != 3 ||
+     strcmp(b, "ijk") != 0){
+    printf(1, "iov: offset moved\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("iov.data", O_RDONLY);
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  iov[0].iov_base = a;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = b;
+  iov[1].iov_len = 7;
+  if(readv(fd, iov, 2) != 11 || strcmp(a, "abcd") != 0 ||
+     strcmp(b, "XYghijk") != 0){
+    printf(1, "iov: readv wrong\n");
+    exit();
+  }
+  if(readv(fd, iov, 2) != 0 || readv(fd, iov, IOV_MAX+1) != -1){
+    printf(1, "iov: readv past end\n");
+    exit();
+  }
+  close(fd);
+
+  for(i = 0; i < 3; i++){
+    iov[i].iov_base = buf + i*100;
+    iov[i].iov_len = 100;
+  }
+  iov[1].iov_base = (char*)0xfffff000;
+  fd = open("iov.data", O_RDWR);
+  if(writev(fd, iov, 3) != -1){
+    printf(1, "iov: bad buffer accepted\n");
+    exit();
+  }
+  close(fd);
+  unlink("iov.data");
+  printf(1, "iov test ok\n");
+}
+
+// a process can hold far more than the old 16 descriptors,
+// always gets the lowest free one, and passes them all on
+// to a forked child.
+void
+manyfds(void)
+{
+  int fd, i, n, pid;
+
+  printf(1, "manyfds test\n");
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf(1, "manyfds: open README failed\n");
+    exit();
+  }
+  for(n = fd + 1; n < 300; n++){
+    if(dup(fd) != n){
+      printf(1, "manyfds: dup gave wrong fd\n");
+      exit();
+    }
+  }
+  close(fd + 5);
+  close(fd + 200);
+  if(dup(fd) != fd + 5 || dup(fd) != fd + 200 || dup(fd) != 300){
+    printf(1, "manyfds: not lowest free fd\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "manyfds: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(read(250, buf, 1) != 1){
+      printf(1, "manyfds: child lost fd\n");
+      exit();
+    }
+    exit();
+  }
+  wait();
+  for(i = fd; i <= 300; i++)
+    close(i);
+  printf(1, "manyfds test ok\n");
+}
+
+// initialized data comes from the executable, so its page
+// starts out shared with every process running usertests.
+char imgdata[16] = "image";
+
+void
+imagetest(void)
+{
+  int fds[2], pid;
+
+  printf(1, "image test\n");
+  pid = fork();
+  if(pid < 0){
+    printf(1, "image: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    imgdata[0] = 'X';
+    exit();
+  }
+  wait();
+  if(strcmp(imgdata, "image") != 0){
+    printf(1, "image: child write leaked\n");
+    exit();
+  }
+  // the kernel copies into the page while holding the pipe lock
+  if(pipe(fds) != 0){
+    printf(1, "image: pipe() failed\n");
+    exit();
+  }
+  write(fds[1], "IMAGE", 5);
+  if(read(fds[0], imgdata, 5) != 5 || strcmp(imgdata, "IMAGE") != 0){
+    printf(1, "image: read into data failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  printf(1, "image test ok\n");
+}
+
+// an executable stays cached after it exits, but writing
+// to the file must drop the cached copy.
+void
+imgcachetest(void)
+{
+  char *args[] = { "echoimg", "image", "cache", 0 };
+  int fd, fd1, n, pid, fds[2];
+
+  printf(1, "image cache test\n");
+  fd = open("echo", O_RDONLY);
+  fd1 = open("echoimg", O_CREATE|O_RDWR);
+  if(fd < 0 || fd1 < 0){
+    printf(1, "image cache: open failed\n");
+    exit();
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(fd1, buf, n);
+  close(fd);
+  close(fd1);
+
+  pid = fork();
+  if(pid == 0){
+    exec("echoimg", args);
+    printf(1, "image cache: exec echoimg failed\n");
+    exit();
+  }
+  wait();
+
+  // clobber the ELF header; exec must now see the new bytes
+  fd = open("echoimg", O_RDWR);
+  if(fd < 0 || write(fd, "junk", 4) != 4){
+    printf(1, "image cache: rewrite failed\n");
+    exit();
+  }
+  close(fd);
+  if(pipe(fds) != 0){
+    printf(1, "image cache: pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    close(fds[0]);
+    exec("echoimg", args);
+    write(fds[1], "x", 1);
+    exit();
+  }
+  close(fds[1]);
+  if(read(fds[0], buf, 1) != 1){
+    printf(1, "image cache: ran a stale image\n");
+    exit();
+  }
+  close(fds[0]);
+  wait();
+  unlink("echoimg");
+
+  // while a process runs it, the file cannot change
+  fd = open("cat", O_RDONLY);
+  fd1 = open("catimg", O_CREATE|O_RDWR);
+  if(fd < 0 || fd1 < 0){
+    printf(1, "image cache: open failed\n");
+    exit();
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    write(fd1, buf, n);
+  close(fd);
+  close(fd1);
+  if(pipe(fds) != 0){
+    printf(1, "image cache: pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    close(fds[1]);
+    close(0);
+    dup(fds[0]);
+    close(fds[0]);
+    args[0] = "catimg";
+    args[1] = 0;
+    exec("catimg", args);
+    exit();
+  }
+  close(fds[0]);
+  sleep(10);  // let it get going; it then waits on the pipe
+  fd = open("catimg", O_RDWR);
+  if(fd < 0 || write(fd, "junk", 4) != -1){
+    printf(1, "image cache: rewrote a running program\n");
+    exit();
+  }
+  close(fd);
+  close(fds[1]);
+  wait();
+  unlink("catimg");
+  printf(1, "image cache test ok\n");
+}
+
+// spawn starts a program with the given descriptors and
+// no copy of the caller.
+void
+spawntest(void)
+{
+  char *args[] = { "echo", "spawned", 0 };
+  int fds[2], cfds[3], n, tot;
+
+  printf(1, "spawn test\n");
+  if(pipe(fds) != 0){
+    printf(1, "spawn: pipe() failed\n");
+    exit();
+  }
+  cfds[0] = -1;
+  cfds[1] = fds[1];
+  cfds[2] = 2;
+  if(spawn("echo", args, cfds) < 0){
+    printf(1, "spawn: spawn echo failed\n");
+    exit();
+  }
+  close(fds[1]);
+  tot = 0;
+  while((n = read(fds[0], buf + tot, sizeof(buf) - tot - 1)) > 0)
+    tot += n;
+  buf[tot] = 0;
+  close(fds[0]);
+  if(wait() < 0 || strcmp(buf, "spawned\n") != 0){
+    printf(1, "spawn: wrong output %s\n", buf);
+    exit();
+  }
+
+  if(spawn("nosuchprogram", args, 0) >= 0){
+    printf(1, "spawn: missing program started\n");
+    exit();
+  }
+  cfds[1] = 1000;
+  if(spawn("echo", args, cfds) >= 0){
+    printf(1, "spawn: bad descriptor accepted\n");
+    exit();
+  }
+  printf(1, "spawn test ok\n");
+}
+
+// untouched heap reads as zeros, shrinking frees pages, and
+// memory grown again after a shrink starts out zeroed.
+void
+lazyheap(void)
+{
+  char *a, *p;
+  int n, pid;
+
+  printf(1, "lazy heap test\n");
+  n = 1024*1024;
+  a = sbrk(n);
+  if(a == (char*)-1){
+    printf(1, "lazy heap: sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < a + n; p += 4096){
+    if(*p != 0){
+      printf(1, "lazy heap: not zero\n");
+      exit();
+    }
+  }
+  for(p = a; p < a + n/2; p += 512)
+    *p = 'x';
+  pid = fork();
+  if(pid < 0){
+    printf(1, "lazy heap: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(a[0] != 'x' || a[n-1] != 0){
+      printf(1, "lazy heap: child sees wrong heap\n");
+      exit();
+    }
+    a[n-1] = 'y';
+    exit();
+  }
+  wait();
+  if(a[n-1] != 0){
+    printf(1, "lazy heap: child write leaked\n");
+    exit();
+  }
+  if(sbrk(-n) != a + n || sbrk(0) != a){
+    printf(1, "lazy heap: shrink failed\n");
+    exit();
+  }
+  if(sbrk(n) != a || a[n/4] != 0 || a[n-1] != 0){
+    printf(1, "lazy heap: regrown heap not zero\n");
+    exit();
+  }
+  sbrk(-n);
+  printf(1, "lazy heap test ok\n");
+}
+
+// a big heap is mapped with 4MB superpages where it can be;
+// check they survive fork, partial shrink and a full shrink.
+void
+superheap(void)
+{
+  char *a, *p;
+  int n, pid;
+
+  printf(1, "superpage heap test\n");
+  n = 12*1024*1024;
+  a = sbrk(n);
+  if(a == (char*)-1){
+    printf(1, "superpage heap: sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < a + n; p += 4096)
+    *p = (uint)p >> 12;
+  pid = fork();
+  if(pid < 0){
+    printf(1, "superpage heap: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(p = a; p < a + n; p += 4096){
+      if(*p != (char)((uint)p >> 12)){
+        printf(1, "superpage heap: child sees wrong heap\n");
+        exit();
+      }
+      *p = 0;
+    }
+    exit();
+  }
+  wait();
+  for(p = a; p < a + n; p += 4096){
+    if(*p != (char)((uint)p >> 12)){
+      printf(1, "superpage heap: child write leaked\n");
+      exit();
+    }
+  }
+  // Ends in the middle of a superpage.
+  if(sbrk(-n/2) != a + n){
+    printf(1, "superpage heap: shrink failed\n");
+    exit();
+  }
+  for(p = a; p < a + n/2; p += 4096){
+    if(*p != (char)((uint)p >> 12)){
+      printf(1, "superpage heap: shrink lost data\n");
+      exit();
+    }
+  }
+  if(sbrk(n/2) != a + n/2 || a[n-1] != 0){
+    printf(1, "superpage heap: regrown heap not zero\n");
+    exit();
+  }
+  sbrk(-n);
+  printf(1, "superpage heap test ok\n");
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(void)
@@ -1745,6 +2322,379 @@ rand()
   return randstate;
 }
 
+// The buddy allocator's counts add up, and a pipe's
+// multi-page buffer goes back to it whole on close.
+void
+buddytest(void)
+{
+  struct memstat st;
+  int fds[2], i, n, before;
+
+  printf(1, "buddy test\n");
+  if(memstat(&st) < 0){
+    printf(1, "buddy: memstat failed\n");
+    exit();
+  }
+  n = 0;
+  for(i = 0; i <= MAXORDER; i++)
+    n += st.nblock[i] << i;
+  if(n != st.free || st.free > st.total){
+    printf(1, "buddy: %d pages in blocks, %d free\n", n, st.free);
+    exit();
+  }
+  before = st.free + st.zeroed;
+  if(pipe(fds) != 0 || pipesize(fds[1], PIPEMAX) != PIPEMAX){
+    printf(1, "buddy: pipe failed\n");
+    exit();
+  }
+  memstat(&st);
+  if(st.free + st.zeroed > before - PIPEMAX/4096){
+    printf(1, "buddy: pipe buffer not allocated\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  memstat(&st);
+  if(st.free + st.zeroed < before - 4){
+    printf(1, "buddy: pipe buffer leaked\n");
+    exit();
+  }
+  printf(1, "buddy test ok\n");
+}
+
+// Sums tpsum[lo, hi) into *sum, in parallel below tpool.
+struct tprange {
+  int lo, hi;
+  uint sum;
+};
+
+uint tpsum[4096];
+int tpdone[1000];
+
+void
+tpsumtask(void *arg)
+{
+  struct tprange *r = arg;
+  struct tprange half[2];
+  struct tpgroup g;
+  int i, mid;
+
+  if(r->hi - r->lo <= 64){
+    r->sum = 0;
+    for(i = r->lo; i < r->hi; i++)
+      r->sum += tpsum[i];
+    return;
+  }
+  mid = (r->lo + r->hi) / 2;
+  half[0].lo = r->lo;
+  half[0].hi = mid;
+  half[1].lo = mid;
+  half[1].hi = r->hi;
+  g.pending = 0;
+  tpool_submit(&g, tpsumtask, &half[0]);
+  tpool_submit(&g, tpsumtask, &half[1]);
+  tpool_wait(&g);
+  r->sum = half[0].sum + half[1].sum;
+}
+
+void
+tpmark(void *arg)
+{
+  tpdone[(int)arg]++;
+}
+
+// Many small tasks, and tasks that wait on tasks of their own.
+void
+tpooltest(void)
+{
+  struct tpgroup g;
+  struct tprange r;
+  uint want;
+  int i;
+
+  printf(1, "tpool test\n");
+  if(tpool_init(4) < 0){
+    printf(1, "tpool: init failed\n");
+    exit();
+  }
+  g.pending = 0;
+  for(i = 0; i < 1000; i++)
+    tpool_submit(&g, tpmark, (void*)i);
+  tpool_wait(&g);
+  for(i = 0; i < 1000; i++){
+    if(tpdone[i] != 1){
+      printf(1, "tpool: task %d ran %d times\n", i, tpdone[i]);
+      exit();
+    }
+  }
+
+  want = 0;
+  for(i = 0; i < 4096; i++){
+    tpsum[i] = i * 7 + 1;
+    want += tpsum[i];
+  }
+  r.lo = 0;
+  r.hi = 4096;
+  g.pending = 0;
+  tpool_submit(&g, tpsumtask, &r);
+  tpool_wait(&g);
+  if(r.sum != want){
+    printf(1, "tpool: sum %d, want %d\n", r.sum, want);
+    exit();
+  }
+  tpool_exit();
+  printf(1, "tpool test ok\n");
+}
+
+// Blocks of many sizes, allocated, filled, checked and freed
+// from several threads at once.
+int mtfail;
+
+void
+malloctask(void *arg)
+{
+  char *p[32];
+  int n[32], i, k, c;
+  uint seed;
+
+  seed = (uint)arg;
+  for(k = 0; k < 50; k++){
+    for(i = 0; i < 32; i++){
+      seed = seed * 1103515245 + 12345;
+      n[i] = 1 + (seed >> 8) % 3000;
+      if((p[i] = malloc(n[i])) == 0){
+        mtfail = 1;
+        return;
+      }
+      memset(p[i], (int)arg * 32 + i, n[i]);
+    }
+    for(i = 0; i < 32; i++){
+      c = (char)((int)arg * 32 + i);
+      if(p[i][0] != c || p[i][n[i]/2] != c || p[i][n[i]-1] != c)
+        mtfail = 1;
+      free(p[i]);
+    }
+  }
+}
+
+void
+malloctest(void)
+{
+  struct tpgroup g;
+  int i;
+
+  printf(1, "malloc test\n");
+  if(tpool_init(4) < 0){
+    printf(1, "malloc: tpool_init failed\n");
+    exit();
+  }
+  g.pending = 0;
+  for(i = 0; i < 8; i++)
+    tpool_submit(&g, malloctask, (void*)i);
+  tpool_wait(&g);
+  tpool_exit();
+  if(mtfail){
+    printf(1, "malloc: blocks overlap or ran out\n");
+    exit();
+  }
+  printf(1, "malloc test ok\n");
+}
+
+// Buffered stdout is written once, in order, across fork()
+// and exit().
+void
+stdiotest(void)
+{
+  int fds[2], save, pid, n, i;
+  char got[32];
+
+  printf(1, "stdio test\n");
+  if(pipe(fds) != 0 || (save = dup(1)) < 0){
+    printf(1, "stdio: pipe failed\n");
+    exit();
+  }
+  close(1);
+  dup(fds[1]);
+  close(fds[1]);
+  printf(1, "a%d", 1);
+  pid = fork();
+  if(pid == 0){
+    printf(1, "b");
+    exit();
+  }
+  wait();
+  printf(1, "c");
+  fflush(1);
+  close(1);
+  dup(save);
+  close(save);
+
+  n = 0;
+  while(n < sizeof(got) - 1 && (i = read(fds[0], got + n, sizeof(got) - 1 - n)) > 0)
+    n += i;
+  close(fds[0]);
+  got[n] = 0;
+  if(strcmp(got, "a1bc") != 0){
+    printf(1, "stdio: got %s, want a1bc\n", got);
+    exit();
+  }
+  printf(1, "stdio test ok\n");
+}
+
+// memmove, memset and the string routines at every alignment
+// and in both directions of overlap.
+void
+stringtest(void)
+{
+  static char a[128], b[128];
+  int i, j, off, n;
+
+  printf(1, "string test\n");
+  for(off = 0; off < 4; off++){
+    for(n = 0; n < 70; n += 3){
+      for(i = 0; i < sizeof(a); i++)
+        a[i] = i;
+      memmove(a + off + 5, a + off, n);
+      for(i = 0; i < n; i++)
+        if(a[off + 5 + i] != (char)(off + i))
+          goto bad;
+      for(i = 0; i < sizeof(a); i++)
+        a[i] = i;
+      memmove(a + off, a + off + 5, n);
+      for(i = 0; i < n; i++)
+        if(a[off + i] != (char)(off + 5 + i))
+          goto bad;
+      memset(b, 'x', sizeof(b));
+      memset(b + off, 'y', n);
+      for(i = 0; i < sizeof(b); i++)
+        if(b[i] != (i >= off && i < off + n ? 'y' : 'x'))
+          goto bad;
+      b[off + n] = 0;
+      if(strlen(b + off) != n)
+        goto bad;
+      memset(a, 'y', sizeof(a));
+      j = (off + n) % 4;
+      a[j + n] = 0;
+      if(strcmp(b + off, a + j) != 0)
+        goto bad;
+      if(n > 0){
+        a[j + n - 1] = 'z';
+        if(strcmp(b + off, a + j) >= 0 || strchr(a + j, 'z') != a + j + n - 1)
+          goto bad;
+      }
+      if(strchr(b + off, 'q') != 0)
+        goto bad;
+    }
+  }
+  printf(1, "string test ok\n");
+  return;
+bad:
+  printf(1, "string: wrong at offset %d length %d\n", off, n);
+  exit();
+}
+
+// clocktime() only moves forward, and agrees with sleep().
+void
+clocktest(void)
+{
+  struct timespec a, b;
+  uint us;
+  int i;
+
+  printf(1, "clock test\n");
+  clocktime(&a);
+  for(i = 0; i < 1000; i++){
+    clocktime(&b);
+    if(b.nsec >= 1000000000 || b.sec < a.sec ||
+       (b.sec == a.sec && b.nsec < a.nsec)){
+      printf(1, "clock: went backwards\n");
+      exit();
+    }
+    a = b;
+  }
+  sleep(10);
+  clocktime(&b);
+  us = (b.sec - a.sec) * 1000000 + b.nsec / 1000 - a.nsec / 1000;
+  // Ten ticks are 100ms; allow for a tick either way.
+  if(us < 90000 || us > 1000000){
+    printf(1, "clock: sleep(10) took %d us\n", us);
+    exit();
+  }
+  printf(1, "clock test ok\n");
+}
+
+void
+lockstattest(void)
+{
+  static struct lockstat st[NLOCKSTAT];
+  uint before;
+  int i, n;
+
+  printf(1, "lockstat test\n");
+  n = lockstat(st, NLOCKSTAT);
+  for(i = 0; i < n; i++)
+    if(strcmp(st[i].name, "ptable") == 0)
+      break;
+  if(i == n){
+    printf(1, "lockstat: no ptable lock\n");
+    exit();
+  }
+  before = st[i].nacquire;
+  yield();
+  if(lockstat(st, i+1) != i+1 || st[i].nacquire == before ||
+     st[i].ncontend > st[i].nacquire){
+    printf(1, "lockstat: counts wrong\n");
+    exit();
+  }
+  printf(1, "lockstat test ok\n");
+}
+
+// Look up the same paths from several processes while they
+// create and remove files beside them, so that inodes leave
+// the cache while others are looking through it.
+void
+lookuptest(void)
+{
+  char file[] = "lkdir/f0";
+  struct stat st;
+  int i, j, fd;
+
+  printf(1, "lookup test\n");
+  if(mkdir("lkdir") < 0){
+    printf(1, "lookup: mkdir failed\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    if(fork() == 0){
+      file[7] = '0' + i;
+      for(j = 0; j < 100; j++){
+        if((fd = open(file, O_CREATE | O_RDWR)) < 0){
+          printf(1, "lookup: create %s failed\n", file);
+          exit();
+        }
+        close(fd);
+        if(stat("/lkdir/../lkdir", &st) < 0 || st.type != T_DIR ||
+           stat(file, &st) < 0 || st.type != T_FILE){
+          printf(1, "lookup: stat failed\n");
+          exit();
+        }
+        if(unlink(file) < 0){
+          printf(1, "lookup: unlink %s failed\n", file);
+          exit();
+        }
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+  if(unlink("lkdir") < 0){
+    printf(1, "lookup: lkdir not empty\n");
+    exit();
+  }
+  printf(1, "lookup test ok\n");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -1781,6 +2731,24 @@ main(int argc, char *argv[])
 
   mem();
   pipe1();
+  pipesizetest();
+  splicetest();
+  polltest();
+  iovtest();
+  manyfds();
+  imagetest();
+  imgcachetest();
+  spawntest();
+  lazyheap();
+  superheap();
+  buddytest();
+  tpooltest();
+  malloctest();
+  stdiotest();
+  stringtest();
+  clocktest();
+  lockstattest();
+  lookuptest();
   preempt();
   exitwait();
 
@@ -6,10 +6,29 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "traps.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "image.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 
+// A CPU keeps the last user page table loaded (cpu->curpgdir)
+// through the scheduler and across switches between threads
+// that share it, so its TLB entries survive.  That means a
+// changed PTE must be flushed on every CPU that has the page
+// table loaded, not only on the one that changed it.
+// tlbflush() posts a request here and interrupts those CPUs.
+struct {
+  struct spinlock lock;
+  pde_t *pgdir;
+  uint va;
+  uint n;     // pages to flush; 0 means unload pgdir
+} tlbreq;
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -29,27 +48,62 @@ seginit(void)
   lgdt(c->gdt, sizeof(c->gdt));
 }
 
+// Replace the 4MB superpage mapping at *pde, which covers
+// va, with a page table mapping the same memory 4KB at a
+// time, so that single pages can be changed or freed.
+static int
+splitpde(pde_t *pde, const void *va)
+{
+  pte_t *pgtab;
+  uint pa;
+  int i;
+
+  if((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  pa = PTE_ADDR(*pde);
+  ksplit(P2V(pa));
+  for(i = 0; i < NPTENTRIES; i++)
+    pgtab[i] = (pa + i*PGSIZE) | (PTE_FLAGS(*pde) & ~PTE_PS);
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  invlpg((void*)PGROUNDDOWN((uint)va));
+  return 0;
+}
+
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
+// If a 4MB superpage maps va, return its PDE, which has
+// the same flags as a PTE, or split it if alloc!=0.
 pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
-  pde_t *pde;
+  pde_t *pde, old;
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
-  if(*pde & PTE_P){
-    pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
-  } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
+  for(;;){
+    if((*pde & PTE_P) && (*pde & PTE_PS)){
+      if(!alloc)
+        return pde;
+      if(splitpde(pde, va) < 0)
+        return 0;
+    }
+    old = *pde;
+    if(old & PTE_P){
+      pgtab = (pte_t*)P2V(PTE_ADDR(old));
+      break;
+    }
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kzalloc()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
-    *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+    // A thread sharing pgdir may fill the PDE at the same time;
+    // the first one in wins and the other looks again.
+    if(cmpxchg(pde, old, V2P(pgtab) | PTE_P | PTE_W | PTE_U) == old)
+      break;
+    kfree((char*)pgtab);
   }
   return &pgtab[PTX(va)];
 }
@@ -121,9 +175,8 @@ setupkvm(void)
   pde_t *pgdir;
   struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kzalloc()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
@@ -141,6 +194,7 @@ void
 kvmalloc(void)
 {
   kpgdir = setupkvm();
+  initlock(&tlbreq.lock, "tlb");
   switchkvm();
 }
 
@@ -173,10 +227,76 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  if(mycpu()->curpgdir != p->pgdir){
+    mycpu()->curpgdir = p->pgdir;
+    lcr3(V2P(p->pgdir));  // switch to process's address space
+  }
   popcli();
 }
 
+// Flush n pages at va from this CPU's TLB, which has c->curpgdir
+// loaded; n == 0 switches to the kernel page table instead.
+static void
+tlbflushcpu(struct cpu *c, uint va, uint n)
+{
+  uint i;
+
+  if(n == 0){
+    c->curpgdir = 0;
+    lcr3(V2P(kpgdir));
+  } else if(n > TLBINVLPG)
+    lcr3(V2P(c->curpgdir));
+  else
+    for(i = 0; i < n; i++)
+      invlpg((char*)va + i*PGSIZE);
+}
+
+// Flush the TLB entries for n pages at va in pgdir on every
+// CPU that has pgdir loaded, and wait until they have.  With
+// n == 0, make every CPU stop using pgdir, so it can be freed.
+// Call after changing the PTEs and before freeing what they
+// pointed to.
+void
+tlbflush(pde_t *pgdir, uint va, uint n)
+{
+  struct cpu *c, *me;
+
+  acquire(&tlbreq.lock);  // the xchg orders the PTE writes first
+  me = mycpu();
+  if(me->curpgdir == pgdir)
+    tlbflushcpu(me, va, n);
+  tlbreq.pgdir = pgdir;
+  tlbreq.va = va;
+  tlbreq.n = n;
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c == me || c->curpgdir != pgdir)
+      continue;
+    c->tlbpending = 1;
+    lapicipi(c->apicid, T_TLBFLUSH);
+  }
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c->tlbpending)
+      ;
+  release(&tlbreq.lock);
+}
+
+// Carry out a pending tlbflush() request for this CPU.
+// Called from the IPI and from acquire() while spinning, since
+// the CPU asking may hold the lock this one is waiting for.
+void
+tlbintr(void)
+{
+  struct cpu *c;
+
+  c = mycpu();
+  if(!c->tlbpending)
+    return;
+  if(c->curpgdir == tlbreq.pgdir)
+    tlbflushcpu(c, tlbreq.va, tlbreq.n);
+  __sync_synchronize();
+  c->tlbpending = 0;
+}
+
 // Load the initcode into address 0 of pgdir.
 // sz must be less than a page.
 void
@@ -186,8 +306,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -231,13 +350,12 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
@@ -248,21 +366,80 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   return newsz;
 }
 
+// Pages unmapped by deallocuvm(), waiting for one TLB flush
+// before they are freed.
+struct unmapbatch {
+  char *page[SWAPBATCH];
+  char super[SWAPBATCH];  // page[i] is a 4MB superpage
+  int n;
+  uint lo, hi;            // lowest and highest address unmapped
+};
+
+static void
+unmapflush(pde_t *pgdir, struct unmapbatch *b)
+{
+  int i;
+
+  if(b->n == 0)
+    return;
+  tlbflush(pgdir, b->lo, (b->hi - b->lo) / PGSIZE);
+  for(i = 0; i < b->n; i++){
+    if(b->super[i])
+      ksuperfree(b->page[i]);
+    else
+      kfree(b->page[i]);
+  }
+  b->n = 0;
+}
+
+// Page v was mapped at [va, va+size) until the caller
+// cleared its entry.
+static void
+unmap(pde_t *pgdir, struct unmapbatch *b, char *v, uint va, uint size)
+{
+  if(b->n == 0 || va < b->lo)
+    b->lo = va;
+  if(b->n == 0 || va + size > b->hi)
+    b->hi = va + size;
+  b->super[b->n] = size == SPGSIZE;
+  b->page[b->n++] = v;
+  if(b->n == SWAPBATCH)
+    unmapflush(pgdir, b);
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Other threads may still be running on pgdir, so
+// the pages are only freed once every TLB has let go of them.
+// Returns the new process size.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
+  pde_t *pde;
   pte_t *pte;
   uint a, pa;
+  struct unmapbatch b;
 
   if(newsz >= oldsz)
     return oldsz;
 
+  b.n = 0;
   a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
+    pde = &pgdir[PDX(a)];
+    if((*pde & PTE_P) && (*pde & PTE_PS)){
+      if(a % SPGSIZE == 0 && a + SPGSIZE <= oldsz){
+        pa = PTE_ADDR(*pde);
+        *pde = 0;
+        unmap(pgdir, &b, P2V(pa), a, SPGSIZE);
+        a += SPGSIZE - PGSIZE;
+        continue;
+      }
+      // Freeing only part of a superpage.
+      if(splitpde(pde, (char*)a) < 0)
+        panic("deallocuvm: split");
+    }
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
@@ -270,11 +447,14 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      *pte = 0;
+      unmap(pgdir, &b, P2V(pa), a, PGSIZE);
+    } else if(*pte & PTE_SWAP){
+      swapfree(SWAPSLOT(*pte));
       *pte = 0;
     }
   }
+  unmapflush(pgdir, &b);
   return newsz;
 }
 
@@ -287,6 +467,7 @@ freevm(pde_t *pgdir)
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
+  tlbflush(pgdir, 0, 0);
   deallocuvm(pgdir, KERNBASE, 0);
   for(i = 0; i < NPDENTRIES; i++){
     if(pgdir[i] & PTE_P){
@@ -323,17 +504,49 @@ copyuvm(pde_t *pgdir, uint sz)
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      //panic("copyuvm: pte should exist");
-      continue;
-    if(!(*pte & PTE_P))
-      continue;
-      //panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
+    pte = &pgdir[PDX(i)];
+    if((*pte & PTE_P) && (*pte & PTE_PS)){
+      // Give the child a superpage too if one is free;
+      // otherwise copy it into ordinary pages below.
+      if((mem = ksuperalloc()) != 0){
+        memmove(mem, P2V(PTE_ADDR(*pte)), SPGSIZE);
+        d[PDX(i)] = V2P(mem) | PTE_FLAGS(*pte);
+        i += SPGSIZE - PGSIZE;
+        continue;
+      }
+      pa = PTE_ADDR(*pte) + (i & (SPGSIZE-1));
+      flags = PTE_FLAGS(*pte) & ~PTE_PS;
+    } else {
+      // Pages never touched stay lazy: the child faults
+      // them in for itself, from its image or as zeros.
+      if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
+        continue;
+      if(*pte & PTE_SWAP){
+        // The child gets its own copy, read from swap.
+        if((mem = kalloc()) == 0)
+          goto bad;
+        swapload(mem, SWAPSLOT(*pte));
+        if(mappages(d, (void*)i, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+          kfree(mem);
+          goto bad;
+        }
+        continue;
+      }
+      if(!(*pte & PTE_P))
+        continue;
+      pa = PTE_ADDR(*pte);
+      flags = PTE_FLAGS(*pte);
+    }
+    if((flags & (PTE_W|PTE_U)) == PTE_U){
+      // Read-only to the user, such as program text:
+      // share it rather than copy it.
+      mem = P2V(pa);
+      kref(mem);
+    } else {
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, (char*)P2V(pa), PGSIZE);
+    }
     if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
       kfree(mem);
       goto bad;
@@ -354,10 +567,12 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
+  if(*pte & PTE_PS)
+    return (char*)P2V(PTE_ADDR(*pte)) + ((uint)uva & (SPGSIZE-PGSIZE));
   return (char*)P2V(PTE_ADDR(*pte));
 }
 
@@ -387,6 +602,280 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
   return 0;
 }
 
+//PAGEBREAK!
+// Give the page table entry pte for va, which maps a
+// copy-on-write page, a page the process can write:
+// the shared page itself if nobody else holds it any
+// more, or else a private copy.
+static int
+cowpage(pte_t *pte, uint va)
+{
+  char *mem;
+  uint pa;
+
+  pa = PTE_ADDR(*pte);
+  if(krefcnt(P2V(pa)) == 1)
+    *pte = (*pte | PTE_W) & ~PTE_COW;
+  else {
+    if(P2V(pa) == kzeropage())
+      mem = kzalloc();
+    else if((mem = kalloc()) != 0)
+      memmove(mem, P2V(pa), PGSIZE);
+    if(mem == 0)
+      return 1;
+    *pte = V2P(mem) | ((PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW);
+    // Threads on other CPUs may still read the old page.
+    tlbflush(myproc()->pgdir, va, 1);
+    kfree(P2V(pa));
+    return 0;
+  }
+  invlpg((void*)va);
+  return 0;
+}
+
+// Read page va of mmap region m into a new page and map it.
+static int
+mmappage(struct proc *p, struct mmap_page *m, uint va)
+{
+  char *mem;
+  int n, perm;
+
+  if((mem = kzalloc()) == 0)
+    return 1;
+  n = PGSIZE;
+  if(va + n > m->addr + m->length)
+    n = m->addr + m->length - va;
+  ilock(m->f->ip);
+  readi(m->f->ip, mem, va - m->addr + m->offset, n);
+  iunlock(m->f->ip);
+
+  perm = PTE_U;
+  if(m->prot & MAP_PROT_WRITE)
+    perm |= PTE_W;
+  if(mappages(p->pgdir, (void*)va, PGSIZE, V2P(mem), perm) < 0){
+    kfree(mem);
+    return 1;
+  }
+  return 0;
+}
+
+// Read page va back in from swap.
+static int
+swappage(struct proc *p, uint va)
+{
+  pte_t *pte;
+  uint old;
+  char *mem;
+
+  if((mem = kalloc()) == 0)
+    return 1;
+  old = *walkpgdir(p->pgdir, (char*)va, 0);
+  swapload(mem, SWAPSLOT(old));
+  // A thread sharing the page table may have beaten us.
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(pte == 0 || *pte != old){
+    kfree(mem);
+    return 0;
+  }
+  *pte = V2P(mem) | PTE_P | PTE_W | PTE_U;
+  swapfree(SWAPSLOT(old));
+  return 0;
+}
+
+// The process just wrote a fresh zero-filled page at va.
+// If the page below is in use too, it is probably growing
+// its heap in order: fill in the next few pages now rather
+// than take a fault for each.
+static void
+faultaround(struct proc *p, uint va)
+{
+  pte_t *pte;
+  char *mem;
+  uint a;
+
+  if(va < PGSIZE || (p->img && va < PGROUNDUP(p->img->sz)))
+    return;
+  pte = walkpgdir(p->pgdir, (char*)(va - PGSIZE), 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_W|PTE_U)) != (PTE_P|PTE_W|PTE_U))
+    return;
+  for(a = va + PGSIZE; a < va + FAULTAROUND*PGSIZE && a < p->sz; a += PGSIZE){
+    if((pte = walkpgdir(p->pgdir, (char*)a, 0)) != 0 && *pte)
+      break;
+    if((pte = walkpgdir(p->pgdir, (char*)a, 1)) == 0)
+      break;
+    if((mem = kzalloc()) == 0)
+      break;
+    *pte = V2P(mem) | PTE_W | PTE_U | PTE_P;
+  }
+}
+
+// The process just wrote heap address va.  If the whole
+// 4MB around va is heap that has never been touched, map it
+// all at once with one superpage: one fault, one TLB entry
+// and no page table.  Returns 0 if it did.
+static int
+superfault(struct proc *p, uint va)
+{
+  uint base;
+  pde_t old;
+  char *mem;
+
+  base = va & ~(SPGSIZE-1);
+  if(base == 0 || base + SPGSIZE > p->sz || base + SPGSIZE < base)
+    return -1;
+  if(p->img && base < PGROUNDUP(p->img->sz))
+    return -1;
+  old = p->pgdir[PDX(base)];
+  if(old & PTE_P)
+    return -1;
+  if((mem = ksuperalloc()) == 0)
+    return -1;
+  memset(mem, 0, SPGSIZE);
+  if(cmpxchg(&p->pgdir[PDX(base)], old, V2P(mem) | PTE_PS | PTE_P | PTE_W | PTE_U) != old){
+    // A thread sharing the page table got here first, with a
+    // superpage or a page table; retry the access against it.
+    ksuperfree(mem);
+    return 0;
+  }
+  return 0;
+}
+
+// Handle a page fault at page va in process p.  Returns 0
+// if the access can be retried, -1 if the process touched
+// memory it does not own, or 1 if there was no free page.
+// Unless canwait is set, pages that must be read from disk
+// count as not owned, since reading them would sleep.
+static int
+fault(struct proc *p, uint va, int write, int canwait)
+{
+  struct mmap_page *m;
+  pte_t *pte;
+  char *mem, *priv;
+  int i, perm;
+
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(pte && (*pte & PTE_SWAP))
+    return canwait ? swappage(p, va) : -1;
+  if(pte && (*pte & PTE_P)){
+    if((*pte & PTE_U) == 0)
+      return -1;
+    if(write && (*pte & PTE_W) == 0){
+      if((*pte & PTE_COW) == 0)
+        return -1;
+      return cowpage(pte, va);
+    }
+    // Stale TLB entry, e.g. another thread changed the PTE.
+    invlpg((void*)va);
+    return 0;
+  }
+
+  for(i = 0; i < MAX_MMAP_PROC; i++){
+    m = &p->mmaps[i];
+    if(m->used && va >= m->addr && va < m->addr + m->length){
+      if(write && !(m->prot & MAP_PROT_WRITE)){
+        cprintf("mmap write protection\n");
+        return -1;
+      }
+      return canwait ? mmappage(p, m, va) : -1;
+    }
+  }
+
+  if(va >= p->sz)
+    return -1;
+  if(write && superfault(p, va) == 0)
+    return 0;
+  mem = 0;
+  perm = PTE_W|PTE_U;
+  if(p->img && !canwait && va < PGROUNDUP(p->img->sz))
+    return -1;
+  if(p->img && (i = imgpage(p->img, va, &mem)) != 0)
+    return i;
+  if(mem && write){
+    // Written right away: skip the shared mapping.
+    if((priv = kalloc()) == 0){
+      kfree(mem);
+      return 1;
+    }
+    memmove(priv, mem, PGSIZE);
+    kfree(mem);
+    mem = priv;
+  } else if(mem)
+    perm = PTE_U|PTE_COW;
+  else if(!write){
+    // Read before it was ever written: share the zero page.
+    mem = kzeropage();
+    perm = PTE_U|PTE_COW;
+  } else {
+    if((mem = kzalloc()) == 0)
+      return 1;
+  }
+
+  // imgpage() may have slept; a thread sharing the page
+  // table could have filled the page in meanwhile.
+  if((pte = walkpgdir(p->pgdir, (char*)va, 1)) == 0){
+    kfree(mem);
+    return 1;
+  }
+  if(*pte){
+    kfree(mem);
+    return 0;
+  }
+  *pte = V2P(mem) | perm | PTE_P;
+  if(perm == (PTE_W|PTE_U))
+    faultaround(p, va);
+  return 0;
+}
+
+// Handle a page fault at user address va in the current
+// process, write saying whether it was a write.  Fills in
+// an mmap page, a page of the executable, a page from swap
+// or a zero-filled heap or stack page, or breaks a
+// copy-on-write share.  If memory is short, waits for
+// kswapd; user says the fault came from user space, so the
+// process may evict pages of its own meanwhile.
+// Returns 0 if the access can be retried, -1 if the
+// process touched memory it does not own or memory ran out.
+// A kernel copy holding a spinlock must not sleep, so such a
+// fault fails rather than wait for memory or the disk.
+int
+pagefault(uint va, int write, int user)
+{
+  struct proc *p = myproc();
+  int r, canwait;
+
+  if(p == 0 || va >= KERNBASE)
+    return -1;
+  pushcli();
+  canwait = mycpu()->ncli == 1;
+  popcli();
+  va = PGROUNDDOWN(va);
+  while((r = fault(p, va, write, canwait)) > 0)
+    if(!canwait || kreclaim(user) < 0)
+      return -1;
+  return r;
+}
+
+// Fault in any missing pages of the current process from
+// va to va+n, so that the kernel can copy to and from them
+// while holding a spinlock, or an inode lock that reading
+// the page in would need.  If write is set the kernel will
+// write there, so copy-on-write pages are broken now too.
+// Callers fault in only what they are about to copy.
+int
+prefault(uint va, uint n, int write)
+{
+  pte_t *pte;
+  uint a, need;
+
+  need = write ? PTE_P|PTE_W : PTE_P;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(myproc()->pgdir, (char*)a, 0);
+    if((pte == 0 || (*pte & need) != need) && pagefault(a, write, 0) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 //PAGEBREAK!
 // Blank page.
 //PAGEBREAK!